@@ -61,7 +61,8 @@ func set_light_modulate(value: Color) -> void:
 
 @export_category("Movement")
 ## Can swap position with less dense cell.
-@export var density := 0
+## Stored as a 16 bits integer while stepping.
+@export_range(-32768, 32767) var density := 0
 
 ## How many vertical movement per step.
 ## Negative value moves upwards.
@@ -9,6 +9,10 @@ class_name CellReaction
 ## coord will be at in1.
 ## This will be called at the very end of step
 ## which gives full exclusive read/write access to Grid.
+## When a reaction triggers often, add instead:
+## func callback_batch(coords: PackedVector2iArray) -> void:
+## It is called once per step with every coord, in the same order
+## callback would have been called with.
 ## All properties can be modified while in-game.
 ## For changes to take effect, call add().
 
@@ -41,7 +45,11 @@ func add() -> void:
 		return
 	
 	var callback := Callable()
-	if has_method(&"callback"):
+	var batch_callback := false
+	if has_method(&"callback_batch"):
+		callback = Callable(self, &"callback_batch")
+		batch_callback = true
+	elif has_method(&"callback"):
 		callback = Callable(self, &"callback")
 	
 	for in1 in GridApi.find_cell_material_tag(in1_tag):
@@ -52,7 +60,8 @@ func add() -> void:
 				out1.idx,
 				out2.idx,
 				probability,
-				callback))
+				callback,
+				batch_callback))
 
 func remove() -> void:
 	for reaction_id in reactions_id:
@@ -15,7 +15,7 @@ var padding := 50
 ## What the camera sees.
 static var view := Rect2()
 ## Part of the grid which is rendered.
-## Always mutiple of 32.
+## Size is always a multiple of 32.
 static var raw_cell_rect := Rect2i()
 static var _last_raw_cell_size := Vector2i()
 
@@ -29,12 +29,19 @@ static var _last_raw_cell_size := Vector2i()
 @onready var cell_raw_data_foreground : ImageTexture = $Foreground.texture
 @onready var cell_raw_data_background : ImageTexture = $Backgroud.texture
 
+## Only copy chunks which changed or entered raw_cell_rect since last frame.
+## Cells are at their coord modulo raw_cell_rect.size. See cell_texel in shaders.
+## Foreground and background are copied together, reading each chunk once.
+var _cell_buffer := CellBuffer.new()
+
 func _init() -> void:
 	node = self
 	show() # Hidden on the editor, because it's just a black box there.
 
 func _ready() -> void:
 	light_pass_viewport.set_world_2d(get_world_2d())
+	_cell_buffer.wrap = true
+	_cell_buffer.background = true
 
 func _process(_delta: float) -> void:
 	var ctrans := get_canvas_transform()
@@ -56,17 +63,19 @@ func _process(_delta: float) -> void:
 		raw_cell_rect.size.y = _last_raw_cell_size.y
 	else:
 		raw_cell_rect.size.y += 1
+	# Wrapping cell buffers need whole chunks.
+	raw_cell_rect.size = (raw_cell_rect.size + Vector2i(31, 31)) / 32 * 32
 	_last_raw_cell_size = raw_cell_rect.size
 	
-	var fg_buffer := Grid.get_cell_buffer(raw_cell_rect, false, false)
-	var bg_buffer := Grid.get_cell_buffer(raw_cell_rect, true, false)
+	var updated := _cell_buffer.update(raw_cell_rect)
 	if raw_cell_rect.size != Vector2i(cell_raw_data_foreground.get_size()):
-		cell_raw_data_foreground.set_image(fg_buffer)
-		cell_raw_data_background.set_image(bg_buffer)
+		cell_raw_data_foreground.set_image(_cell_buffer.get_image())
+		cell_raw_data_background.set_image(_cell_buffer.get_background_image())
 		#print_debug("New raw cell texture size: ", raw_cell_rect.size)
-	else:
-		cell_raw_data_foreground.update(fg_buffer)
-		cell_raw_data_background.update(bg_buffer)
+	elif !updated.is_empty():
+		# Textures can only be updated whole, so skip them when nothing changed.
+		cell_raw_data_foreground.update(_cell_buffer.get_image())
+		cell_raw_data_background.update(_cell_buffer.get_background_image())
 	
 	position = raw_cell_rect.position
 	
@@ -52,43 +52,50 @@ var _delete_node : Node = null
 
 ## chunks to be updated next step.
 var queue_step_chunk_rect : Array[Rect2i] = []
-var _step_thread := Thread.new()
+## Most chunks stepped per tick. 0 means unlimited.
+## Chunks over it are deferred, those far from view first.
+## Needs to be the same for all peers.
+var max_step_chunks := 0
 var _current_step_chunk_rect : Array[Rect2i] = []
-## {chunk_coord(Vector2i) : to_be_generated(bool)}
-var _chunk_to_generate := {}
-## passe([column([x(int), ys([int])])])
-var _passes : Array[Array] = [[], [], []]
-var _current_pass_idx := 0
 
 func _exit_tree() -> void:
 	unload_mods()
 
 func _process(_delta: float) -> void:
-	if is_server && !_next_edits.is_empty():
-		# Send queued grid edits to peers
-		if multiplayer.has_multiplayer_peer():
-			_edit_peer(Grid.get_tick(), var_to_bytes(_next_edits))
-		
-		_queued_edits[Grid.get_tick()] = _next_edits
-		_next_edits = []
-	
 	# Step up to 2 times if behind
 	for i in 2:
-		if _queued_edits.has(Grid.get_tick()):
-			var edits := _queued_edits[Grid.get_tick()] as Array
-			_queued_edits.erase(Grid.get_tick())
-			
-			# It safe to modify the grid when not stepping.
-			if _step_thread.is_started():
-				_step_thread.wait_to_finish()
-			
-			for args in edits:
-				_edit_callables[args.pop_back()].callv(args)
+		# Don't wait for a slow step. Simulation slows down instead of the whole game.
+		# New edits keep being added to _next_edits until the step is finished.
+		var tick_waiting := _queued_edits.has(Grid.get_tick()) || (is_server && !_next_edits.is_empty())
+		if !Grid.try_finish_step(tick_waiting):
+			return
+		
+		if is_server && !_next_edits.is_empty():
+			# Send queued grid edits to peers
+			if multiplayer.has_multiplayer_peer():
+				_edit_peer(Grid.get_tick(), var_to_bytes(_next_edits))
 			
-			# During prepare, grid can't be read/write, so we block.
-			_step_prepare()
-			# Can read, but not write to Grid now.
-			_step_thread.start(_step, Thread.PRIORITY_HIGH)
+			_queued_edits[Grid.get_tick()] = _next_edits
+			_next_edits = []
+		
+		if !_queued_edits.has(Grid.get_tick()):
+			return
+		
+		var edits := _queued_edits[Grid.get_tick()] as Array
+		_queued_edits.erase(Grid.get_tick())
+		
+		# It safe to modify the grid when not stepping.
+		for args in edits:
+			_edit_callables[args.pop_back()].callv(args)
+		
+		# During prepare, grid can't be read/write, so we block.
+		_step_prepare()
+		# Can read, but not write to Grid now.
+		Grid.start_step(_step)
+		
+		# Catch up only if the step was quick enough to already be finished.
+		if !_queued_edits.has(Grid.get_tick()):
+			return
 
 func find_cell_material(cell_material_name: StringName) -> CellMaterial:
 	return cell_material_names[cell_material_name]
@@ -205,6 +212,7 @@ func load_mods() -> void:
 			cell_reaction.add()
 	
 	# Add generation passes
+	Grid.set_generate_chunk_callback(_generate_chunk)
 	for entry in mod_entries:
 		if !entry.generation_passes:
 			continue
@@ -230,8 +238,7 @@ func load_mods() -> void:
 	#Grid.print_internals()
 
 func unload_mods() -> void:
-	if _step_thread.is_started():
-		_step_thread.wait_to_finish()
+	Grid.finish_step()
 	
 	for entry in mod_entries:
 		if entry.entry_script:
@@ -271,42 +278,17 @@ func _edit_peer(tick: int, bytes: PackedByteArray) -> void:
 func _step_prepare() -> void:
 	Grid.set_tick(Grid.get_tick() + 1)
 	
-	for p in _passes:
-		p.clear()
-	
-	_chunk_to_generate.clear()
-	
 	_current_step_chunk_rect.clear()
 	var tmp := _current_step_chunk_rect
 	_current_step_chunk_rect = queue_step_chunk_rect
 	queue_step_chunk_rect = tmp
 	
-	# {x(int) : ys(Array[int])}
-	var columns := {}
+	# Create new chunks. They are generated while stepping.
+	Grid.prepare_step_rects(_current_step_chunk_rect)
 	
-	for rect in _current_step_chunk_rect:
-		# Create new chunks.
-		for y_offset in rect.size.y + 2:
-			for x_offset in rect.size.x + 2:
-				var chunk_coord := Vector2i(
-					rect.position.x - 1 + x_offset,
-					rect.position.y - 1 + y_offset)
-				if Grid.try_create_chunk(chunk_coord):
-					_chunk_to_generate[chunk_coord] = true
-		
-		# Add chunk to passes.
-		for y_offset in rect.size.y:
-			for x_offset in rect.size.x:
-				var chunk_coord := Vector2i(
-					rect.position.x + x_offset,
-					rect.position.y + y_offset)
-				var pass_idx := Grid.mod_neg(chunk_coord.x, 3)
-				if columns.has(chunk_coord.x):
-					columns[chunk_coord.x].push_back(chunk_coord.y)
-				else:
-					var ys : Array[int] = [chunk_coord.y]
-					columns[chunk_coord.x] = ys
-					_passes[pass_idx].push_back([chunk_coord.x, ys])
+	# Free memory from chunks that have not been stepped in a while.
+	Grid.unload_old_chunks(_current_step_chunk_rect)
+	Grid.compress_old_chunks(_current_step_chunk_rect)
 
 func _step() -> void:
 	Grid.pre_step()
@@ -320,40 +302,14 @@ func _step() -> void:
 			if !_generation_data.has(slice_idx):
 				_generate_slice(slice_idx)
 	
-	for i in 3:
-		_current_pass_idx = i
-		
-		var group_id := WorkerThreadPool.add_group_task(
-			_step_column,
-			_passes[i].size())
-		WorkerThreadPool.wait_for_group_task_completion(group_id)
-	
-	Grid.post_step()
-
-func _step_column(column_idx: int) -> void:
-	var x : int = _passes[_current_pass_idx][column_idx][0]
-	var ys : Array[int] = _passes[_current_pass_idx][column_idx][1]
+	# Game queues the view grown by 2 chunks.
+	var priority_rects : Array[Rect2i] = []
+	for rect in _current_step_chunk_rect:
+		priority_rects.push_back(rect.grow(-2))
 	
-	ys.sort()
-	ys.reverse()
+	Grid.step_active_rects(_current_step_chunk_rect, max_step_chunks, priority_rects)
 	
-	var y := Global.INT_MAX
-	for maybe_y : int in ys:
-		if y == maybe_y:
-			continue
-		y = maybe_y
-		_step_chunk(Vector2i(x, y))
-
-func _step_chunk(chunk_coord : Vector2i) -> void:
-	# Generate new chunks.
-	for y in 3:
-		for x in 3:
-			var other_chunk_coord := chunk_coord - Vector2i.ONE + Vector2i(x, y)
-			if _chunk_to_generate.get(other_chunk_coord, false):
-				_generate_chunk(other_chunk_coord)
-				_chunk_to_generate[other_chunk_coord] = false
-	
-	Grid.step_chunk(chunk_coord)
+	Grid.post_step()
 
 func _generate_slice(slice_idx: int) -> void:
 	# set_tick reset Grid's rng.
@@ -367,6 +323,7 @@ func _generate_slice(slice_idx: int) -> void:
 	
 	Grid.set_tick(tick)
 
+## Called by Grid.step_active_rects on worker threads.
 func _generate_chunk(chunk_coord: Vector2i) -> void:
 	var iter := Grid.iter_chunk(chunk_coord)
 	var data : GenerationData = _generation_data[GenerationData.compute_slice_idx(chunk_coord.x)]
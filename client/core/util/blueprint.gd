@@ -6,9 +6,12 @@ class_name Blueprint
 
 static func take(rect: Rect2i, take_background: bool) -> Blueprint:
 	var bp := Blueprint.new()
-	bp.foreground = Grid.get_cell_buffer(rect, false, true)
 	if take_background:
-		bp.background = Grid.get_cell_buffer(rect, true, true)
+		var images := Grid.get_cell_buffers(rect, true)
+		bp.foreground = images[0]
+		bp.background = images[1]
+	else:
+		bp.foreground = Grid.get_cell_buffer(rect, false, true)
 	return bp
 
 func get_material_idx(local_coord: Vector2i) -> int:
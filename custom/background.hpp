@@ -0,0 +1,303 @@
+#ifndef BACKGROUND_HPP
+#define BACKGROUND_HPP
+
+#include "pool.hpp"
+#include "preludes.h"
+#include <atomic>
+#include <cstring>
+
+// Background cells of a chunk.
+//
+// Background cells never move or react, so a chunk only has a few different values.
+// They are stored as a palette followed by 4 bits indices,
+// 8 bits indices past 16 values and raw cells past 256 values.
+// Nothing is allocated while every cell is 0. Raw cells are kept until freed.
+//
+// Blocks are retired instead of freed and block and bits change under a seqlock,
+// so decode_shared can read while another thread writes. See Grid::reclaim_retired_blocks.
+class Background {
+	// Palette of 16 followed by 2 cells per byte.
+	static constexpr u64 BLOCK_SIZE_4 = 16 * sizeof(u32) + 32 * 32 / 2;
+	// Palette of 256 followed by 1 cell per byte.
+	static constexpr u64 BLOCK_SIZE_8 = 256 * sizeof(u32) + 32 * 32;
+	static constexpr u64 BLOCK_SIZE_RAW = 32 * 32 * sizeof(u32);
+
+	inline static BlockPool<BLOCK_SIZE_4, 64> pool_4 = {};
+	inline static BlockPool<BLOCK_SIZE_8, 32> pool_8 = {};
+	inline static BlockPool<BLOCK_SIZE_RAW, 16> pool_raw = {};
+
+	u8 *block = nullptr;
+	// 0 while empty, 4, 8 or 32 (raw).
+	u32 bits = 0;
+	u32 palette_size = 0;
+	// Odd while block and bits change.
+	std::atomic<u32> layout_seq = 0;
+
+	inline void begin_layout_change() {
+		layout_seq.fetch_add(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+
+	inline void end_layout_change() {
+		layout_seq.fetch_add(1, std::memory_order_release);
+	}
+
+	inline static u32 palette_capacity(u32 bits) {
+		return bits == 4 ? 16 : 256;
+	}
+
+	inline u32 palette_capacity() {
+		return palette_capacity(bits);
+	}
+
+	inline u32 *palette() {
+		return reinterpret_cast<u32 *>(block);
+	}
+
+	inline u8 *indices() {
+		return block + palette_capacity() * sizeof(u32);
+	}
+
+	inline u32 get_index(u32 i) {
+		if (bits == 4) {
+			return (indices()[i >> 1] >> ((i & 1) * 4)) & 15;
+		} else {
+			return indices()[i];
+		}
+	}
+
+	inline void set_index(u32 i, u32 idx) {
+		if (bits == 4) {
+			u8 &byte = indices()[i >> 1];
+			u32 shift = (i & 1) * 4;
+			byte = u8((byte & ~(15u << shift)) | (idx << shift));
+		} else {
+			indices()[i] = u8(idx);
+		}
+	}
+
+	// Allocate a block for a number of different cells. Previous block needs to be freed.
+	inline void alloc(u32 num_values) {
+		begin_layout_change();
+		if (num_values <= 16) {
+			bits = 4;
+			block = reinterpret_cast<u8 *>(pool_4.alloc());
+		} else if (num_values <= 256) {
+			bits = 8;
+			block = reinterpret_cast<u8 *>(pool_8.alloc());
+		} else {
+			bits = 32;
+			block = reinterpret_cast<u8 *>(pool_raw.alloc());
+		}
+		palette_size = 0;
+		end_layout_change();
+	}
+
+	// Rebuild with room for one more value.
+	// Drop palette values which are not used anymore.
+	inline void repack() {
+		u32 cells[32 * 32];
+		decode(cells);
+		free();
+		load(cells, 1);
+	}
+
+public:
+	inline bool is_empty() {
+		return bits == 0;
+	}
+
+	inline u32 get(u32 i) {
+		TEST_ASSERT(i < 32 * 32, "background cell out of bound");
+
+		if (bits == 0) {
+			return 0;
+		} else if (bits == 32) {
+			return reinterpret_cast<u32 *>(block)[i];
+		} else {
+			return palette()[get_index(i)];
+		}
+	}
+
+	inline void set(u32 i, u32 cell) {
+		TEST_ASSERT(i < 32 * 32, "background cell out of bound");
+
+		if (bits == 0) {
+			if (cell == 0) {
+				return;
+			}
+			alloc(2);
+			palette()[0] = 0;
+			palette_size = 1;
+			std::memset(indices(), 0, 32 * 32 * 4 / 8);
+		}
+
+		if (bits == 32) {
+			reinterpret_cast<u32 *>(block)[i] = cell;
+			return;
+		}
+
+		u32 *pal = palette();
+		u32 idx = 0;
+		while (idx < palette_size && pal[idx] != cell) {
+			idx += 1;
+		}
+		if (idx == palette_size) {
+			if (palette_size == palette_capacity()) {
+				repack();
+				set(i, cell);
+				return;
+			}
+			pal[idx] = cell;
+			palette_size += 1;
+		}
+		set_index(i, idx);
+	}
+
+	// Replace content with cells.
+	// Reserve room for extra different values.
+	inline void load(const u32 *cells, u32 extra = 0) {
+		free();
+
+		u32 values[257];
+		u32 num_values = 0;
+		for (u32 i = 0; i < 32 * 32 && num_values <= 256; i++) {
+			u32 idx = 0;
+			while (idx < num_values && values[idx] != cells[i]) {
+				idx += 1;
+			}
+			if (idx == num_values) {
+				values[num_values] = cells[i];
+				num_values += 1;
+			}
+		}
+
+		if (num_values == 1 && values[0] == 0) {
+			return;
+		}
+
+		alloc(num_values + extra);
+		if (bits == 32) {
+			std::memcpy(block, cells, BLOCK_SIZE_RAW);
+			return;
+		}
+
+		std::memcpy(palette(), values, num_values * sizeof(u32));
+		palette_size = num_values;
+		for (u32 i = 0; i < 32 * 32; i++) {
+			u32 idx = 0;
+			while (values[idx] != cells[i]) {
+				idx += 1;
+			}
+			set_index(i, idx);
+		}
+	}
+
+	inline void decode(u32 *out) {
+		decode_range(0, 32 * 32, out);
+	}
+
+	// Decode cells from start to end into out.
+	inline void decode_range(u32 start, u32 end, u32 *out) {
+		decode_block(block, bits, start, end, out);
+	}
+
+	inline static void decode_block(const u8 *block, u32 bits, u32 start, u32 end, u32 *out) {
+		if (bits == 0) {
+			std::memset(out, 0, (end - start) * sizeof(u32));
+		} else if (bits == 32) {
+			std::memcpy(out, reinterpret_cast<const u32 *>(block) + start, (end - start) * sizeof(u32));
+		} else if (bits == 8) {
+			// Plain gather that compilers can vectorize.
+			const u32 *pal = reinterpret_cast<const u32 *>(block);
+			const u8 *idx = block + palette_capacity(bits) * sizeof(u32);
+			for (u32 i = start; i < end; i++) {
+				out[i - start] = pal[idx[i]];
+			}
+		} else {
+			const u32 *pal = reinterpret_cast<const u32 *>(block);
+			const u8 *idx = block + palette_capacity(bits) * sizeof(u32);
+			for (u32 i = start; i < end; i++) {
+				out[i - start] = pal[(idx[i >> 1] >> ((i & 1) * 4)) & 15];
+			}
+		}
+	}
+
+	// Same as decode, but safe while another thread writes.
+	// Cells may mix old and new values, but are never read out of bounds.
+	// Return false without writing out if empty.
+	inline bool decode_shared(u32 *out) {
+		const u8 *shared_block;
+		u32 shared_bits;
+		while (true) {
+			u32 seq = layout_seq.load(std::memory_order_acquire);
+			shared_block = block;
+			shared_bits = bits;
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if ((seq & 1) == 0 && layout_seq.load(std::memory_order_relaxed) == seq) {
+				break;
+			}
+		}
+
+		if (shared_bits == 0) {
+			return false;
+		}
+		decode_block(shared_block, shared_bits, 0, 32 * 32, out);
+		return true;
+	}
+
+	inline void free() {
+		if (bits == 0) {
+			return;
+		}
+
+		begin_layout_change();
+		if (bits == 4) {
+			pool_4.retire(block);
+		} else if (bits == 8) {
+			pool_8.retire(block);
+		} else {
+			pool_raw.retire(block);
+		}
+		block = nullptr;
+		bits = 0;
+		palette_size = 0;
+		end_layout_change();
+	}
+
+	// Free every background at once.
+	// Any background still in use becomes dangling.
+	inline static void release_all() {
+		pool_4.release_all();
+		pool_8.release_all();
+		pool_raw.release_all();
+	}
+
+	// Free blocks retired since the last call. No decode_shared can still be running.
+	inline static void reclaim_all() {
+		pool_4.reclaim();
+		pool_8.reclaim();
+		pool_raw.reclaim();
+	}
+
+	// Return pages with no background left to the os.
+	inline static void trim_all() {
+		pool_4.trim();
+		pool_8.trim();
+		pool_raw.trim();
+	}
+
+	inline static i64 get_used_bytes() {
+		return pool_4.get_used_bytes() + pool_8.get_used_bytes() + pool_raw.get_used_bytes();
+	}
+
+	inline static i64 get_reserved_bytes() {
+		return pool_4.get_reserved_bytes() + pool_8.get_reserved_bytes() + pool_raw.get_reserved_bytes();
+	}
+
+	inline static u64 get_num_used() {
+		return pool_4.get_num_used() + pool_8.get_num_used() + pool_raw.get_num_used();
+	}
+};
+
+#endif
@@ -0,0 +1,180 @@
+#include "cell_buffer.h"
+#include "core/math/rect2i.h"
+#include "core/math/vector2i.h"
+#include "core/object/class_db.h"
+#include "grid.h"
+#include "preludes.h"
+
+void CellBuffer::_bind_methods() {
+	ClassDB::bind_method(D_METHOD("set_foreground", "value"), &CellBuffer::set_foreground);
+	ClassDB::bind_method(D_METHOD("get_foreground"), &CellBuffer::get_foreground);
+	ClassDB::bind_method(D_METHOD("set_background", "value"), &CellBuffer::set_background);
+	ClassDB::bind_method(D_METHOD("get_background"), &CellBuffer::get_background);
+	ClassDB::bind_method(D_METHOD("set_clean", "value"), &CellBuffer::set_clean);
+	ClassDB::bind_method(D_METHOD("get_clean"), &CellBuffer::get_clean);
+	ClassDB::bind_method(D_METHOD("set_wrap", "value"), &CellBuffer::set_wrap);
+	ClassDB::bind_method(D_METHOD("get_wrap"), &CellBuffer::get_wrap);
+	ClassDB::bind_method(D_METHOD("update", "rect"), &CellBuffer::update);
+	ClassDB::bind_method(D_METHOD("get_image"), &CellBuffer::get_image);
+	ClassDB::bind_method(D_METHOD("get_background_image"), &CellBuffer::get_background_image);
+
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "foreground"), "set_foreground", "get_foreground");
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "background"), "set_background", "get_background");
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "clean"), "set_clean", "get_clean");
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "wrap"), "set_wrap", "get_wrap");
+}
+
+void CellBuffer::set_foreground(bool value) {
+	foreground = value;
+	copied_slots.clear();
+}
+
+bool CellBuffer::get_foreground() {
+	return foreground;
+}
+
+void CellBuffer::set_background(bool value) {
+	background = value;
+	copied_slots.clear();
+}
+
+bool CellBuffer::get_background() {
+	return background;
+}
+
+void CellBuffer::set_clean(bool value) {
+	clean = value;
+	copied_slots.clear();
+}
+
+bool CellBuffer::get_clean() {
+	return clean;
+}
+
+void CellBuffer::set_wrap(bool value) {
+	wrap = value;
+	copied_slots.clear();
+}
+
+bool CellBuffer::get_wrap() {
+	return wrap;
+}
+
+Rect2i CellBuffer::buffer_rect(Vector2i chunk_coord) {
+	if (!wrap) {
+		return rect;
+	}
+
+	// Image size is a multiple of 32, so a chunk is never split by the wrap.
+	Vector2i cell_coord = chunk_coord * 32;
+	return Rect2i(cell_coord - mod_neg(cell_coord, image_size), image_size);
+}
+
+Vector2i CellBuffer::slot_coord(Vector2i chunk_coord) {
+	if (!wrap) {
+		// Everything is copied again when rect moves.
+		return chunk_coord - div_floor(rect.position, 32);
+	}
+
+	return mod_neg(chunk_coord, copied_size);
+}
+
+TypedArray<Rect2i> CellBuffer::update(Rect2i p_rect) {
+	TypedArray<Rect2i> updated_rects = TypedArray<Rect2i>();
+	if (!p_rect.has_area() || !(foreground || background)) {
+		return updated_rects;
+	}
+
+	Vector2i new_image_size = p_rect.size;
+	if (wrap) {
+		new_image_size = (new_image_size + Vector2i(31, 31)) / 32 * 32;
+	}
+
+	bool moved = !wrap && p_rect.position != rect.position;
+	rect = p_rect;
+
+	if (copied_slots.empty() || moved || new_image_size != image_size) {
+		image_size = new_image_size;
+		image = Ref<Image>();
+		if (foreground) {
+			image = Image::create_empty(image_size.x, image_size.y, false, Image::FORMAT_RF);
+		}
+		background_image = Ref<Image>();
+		if (background) {
+			background_image = Image::create_empty(image_size.x, image_size.y, false, Image::FORMAT_RF);
+		}
+		copied_size = wrap ? image_size / 32 : image_size / 32 + Vector2i(2, 2);
+		copied_slots.assign(copied_size.x * copied_size.y, CopiedSlot());
+	}
+
+	u32 *buffer = foreground ? reinterpret_cast<u32 *>(image->ptrw()) : nullptr;
+	u32 *background_buffer = background ? reinterpret_cast<u32 *>(background_image->ptrw()) : nullptr;
+
+	Grid::lock_cell_reads();
+	Vector2i chunk_start = div_floor(rect.position, 32);
+	Vector2i chunk_end = div_floor(rect.get_end() - Vector2i(1, 1), 32) + Vector2i(1, 1);
+	for (i32 y = chunk_start.y; y < chunk_end.y; y++) {
+		for (i32 x = chunk_start.x; x < chunk_end.x; x++) {
+			Vector2i chunk_coord = Vector2i(x, y);
+			Rect2i copy_rect = Rect2i(chunk_coord * 32, Vector2i(32, 32)).intersection(rect);
+			// Read before copying, so a change while copying is not missed.
+			u64 version = Grid::get_chunk_cells_version(chunk_coord);
+
+			Vector2i slot_idx = slot_coord(chunk_coord);
+			CopiedSlot &slot = copied_slots[slot_idx.x + slot_idx.y * copied_size.x];
+			bool up_to_date = false;
+			for (const CopiedChunk &copied : slot.chunks) {
+				if (copied.chunk_coord == chunk_coord &&
+						copied.version == version &&
+						copied.rect.encloses(copy_rect)) {
+					up_to_date = true;
+					break;
+				}
+			}
+			if (up_to_date) {
+				continue;
+			}
+
+			Rect2i chunk_buffer_rect = buffer_rect(chunk_coord);
+			Grid::copy_chunk_layers(chunk_coord, copy_rect, clean, buffer, background_buffer, chunk_buffer_rect);
+			Rect2i updated_rect = Rect2i(copy_rect.position - chunk_buffer_rect.position, copy_rect.size);
+
+			// Forget chunks whose cells were just overwritten.
+			// Chunks which left rect make room, there are never more than 4 touching it.
+			CopiedChunk *free_copied = nullptr;
+			for (CopiedChunk &copied : slot.chunks) {
+				if (copied.chunk_coord == chunk_coord || copied.image_rect.intersects(updated_rect)) {
+					copied = CopiedChunk();
+				}
+				if (free_copied == nullptr && !copied.rect.intersects(rect)) {
+					free_copied = &copied;
+				}
+			}
+			TEST_ASSERT(free_copied != nullptr, "more than 4 chunks in a slot");
+			*free_copied = CopiedChunk{ chunk_coord, version, copy_rect, updated_rect };
+
+			// Merge with the previous chunk of this row when they touch in image.
+			if (!updated_rects.is_empty()) {
+				Rect2i last = updated_rects[updated_rects.size() - 1];
+				if (last.position.y == updated_rect.position.y &&
+						last.size.y == updated_rect.size.y &&
+						last.get_end().x == updated_rect.position.x) {
+					updated_rects[updated_rects.size() - 1] = last.merge(updated_rect);
+					continue;
+				}
+			}
+			updated_rects.push_back(updated_rect);
+		}
+	}
+	Grid::unlock_cell_reads();
+
+	return updated_rects;
+}
+
+Ref<Image> CellBuffer::get_image() {
+	return image;
+}
+
+Ref<Image> CellBuffer::get_background_image() {
+	return background_image;
+}
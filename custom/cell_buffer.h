@@ -0,0 +1,87 @@
+#ifndef CELL_BUFFER_H
+#define CELL_BUFFER_H
+
+#include "core/io/image.h"
+#include "core/math/rect2i.h"
+#include "core/math/vector2i.h"
+#include "core/object/object.h"
+#include "core/object/ref_counted.h"
+#include "core/variant/typed_array.h"
+#include "preludes.h"
+#include <vector>
+
+// Cells of a rect kept between frames for rendering.
+// Same as Grid::get_cell_buffer, but only chunks which changed since the last update are copied.
+//
+// Foreground and background can both be kept, each chunk is then read once for both.
+//
+// With wrap, the image is a ring buffer: a cell is at its coord modulo image size.
+// Moving rect then only copies the chunks entering it.
+class CellBuffer : public RefCounted {
+	GDCLASS(CellBuffer, RefCounted);
+
+protected:
+	static void _bind_methods();
+
+private:
+	struct CopiedChunk {
+		Vector2i chunk_coord = Vector2i();
+		// Grid::get_chunk_cells_version when copied.
+		u64 version = 0;
+		// Cells copied. Empty if none.
+		Rect2i rect = Rect2i();
+		// Where rect was copied in image.
+		Rect2i image_rect = Rect2i();
+	};
+
+	// Chunks whose cells are still in a 32x32 part of image.
+	// With wrap, up to 4 chunks touching rect share a part, each in its own corner.
+	struct CopiedSlot {
+		CopiedChunk chunks[4];
+	};
+
+	bool foreground = true;
+	bool background = false;
+	bool clean = false;
+	bool wrap = false;
+
+	Rect2i rect = Rect2i();
+	Ref<Image> image = Ref<Image>();
+	Ref<Image> background_image = Ref<Image>();
+	// Size of both images.
+	Vector2i image_size = Vector2i();
+
+	// Number of slots per side.
+	Vector2i copied_size = Vector2i();
+	// At slot_coord. Empty when everything needs to be copied.
+	std::vector<CopiedSlot> copied_slots = {};
+
+	// Slot of the part of image holding the cells of chunk_coord.
+	Vector2i slot_coord(Vector2i chunk_coord);
+
+	// Cells held by image where chunk_coord is copied.
+	Rect2i buffer_rect(Vector2i chunk_coord);
+
+public:
+	void set_foreground(bool value);
+	bool get_foreground();
+	void set_background(bool value);
+	bool get_background();
+	void set_clean(bool value);
+	bool get_clean();
+	void set_wrap(bool value);
+	bool get_wrap();
+
+	// Copy cells of rect which changed since the last update into image.
+	// Without wrap, everything is copied when rect changed.
+	// With wrap, only when its size changed. Image size is then rounded up to a multiple of 32.
+	// Return updated rects of images, the same for both layers. Empty if images did not change.
+	// Safe to call while stepping. A chunk changed while it is copied is copied again next update.
+	TypedArray<Rect2i> update(Rect2i p_rect);
+	// FORMAT_RF foreground image of the last updated rect. Null without foreground.
+	Ref<Image> get_image();
+	// FORMAT_RF background image of the last updated rect. Null without background.
+	Ref<Image> get_background_image();
+};
+
+#endif
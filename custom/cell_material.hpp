@@ -26,6 +26,8 @@ struct CellReaction {
 	u16 reaction_id;
 
 	bool callback_swap;
+	// Call callback once per step with every coord as a PackedVector2iArray.
+	bool batch_callback;
 
 	Callable callback;
 
@@ -68,10 +70,13 @@ struct CellMaterial {
 	bool can_reverse_horizontal_movement = false;
 	bool can_color = false;
 
+	inline CellMaterial() {}
+
 	inline CellMaterial(Object *obj) {
 		collision = CellCollision(i32(obj->get("collision_type", nullptr)));
 
-		density = i32(obj->get("density", nullptr));
+		// Stepping keeps it as i16.
+		density = CLAMP(i32(obj->get("density", nullptr)), -32768, 32767);
 
 		vertical_movement = CLAMP(i32(obj->get("vertical_movement", nullptr)), -16, 16);
 
@@ -89,4 +94,86 @@ struct CellMaterial {
 	}
 };
 
+// Which step kernel a material uses. Found from its fields and reactions.
+// Each kernel only removes branches known from the kind, so they all give the same result.
+enum StepKind : u8 {
+	// Never moves on its own and has no reaction.
+	STEP_KIND_STATIC,
+	// Never moves on its own, but has reactions.
+	STEP_KIND_REACTIVE,
+	// Falls and can not reverse or dissipate.
+	STEP_KIND_POWDER,
+	// Falls and reverses when blocked.
+	STEP_KIND_LIQUID,
+	// Rises.
+	STEP_KIND_GAS,
+	// Anything else.
+	STEP_KIND_GENERIC,
+};
+
+// Fields of CellMaterial read while stepping, packed so the used materials stay in L1.
+// See CellMaterial for what each field does.
+struct StepMaterial {
+	enum Flags : u8 {
+		DISSIPATE_ON_HORIZONTAL_MOVEMENT = 1 << 0,
+		CAN_REVERSE_HORIZONTAL_MOVEMENT = 1 << 1,
+	};
+
+	u32 horizontal_movement_start_chance = 0;
+	u32 horizontal_movement_stop_chance = MAX_U32;
+	i16 density = 0;
+	i8 vertical_movement = 0;
+	u8 horizontal_movement = 1;
+	u8 noise_darken_max = 0;
+	u8 flags = 0;
+	StepKind kind = STEP_KIND_GENERIC;
+
+	inline StepMaterial() {}
+
+	inline StepMaterial(const CellMaterial &mat) :
+			horizontal_movement_start_chance(mat.horizontal_movement_start_chance),
+			horizontal_movement_stop_chance(mat.horizontal_movement_stop_chance),
+			density(i16(mat.density)),
+			vertical_movement(i8(mat.vertical_movement)),
+			horizontal_movement(u8(mat.horizontal_movement)),
+			noise_darken_max(u8(mat.noise_darken_max)) {
+		if (mat.dissipate_on_horizontal_movement) {
+			flags |= DISSIPATE_ON_HORIZONTAL_MOVEMENT;
+		}
+		if (mat.can_reverse_horizontal_movement) {
+			flags |= CAN_REVERSE_HORIZONTAL_MOVEMENT;
+		}
+	}
+
+	inline bool dissipate_on_horizontal_movement() const {
+		return (flags & DISSIPATE_ON_HORIZONTAL_MOVEMENT) != 0;
+	}
+
+	inline bool can_reverse_horizontal_movement() const {
+		return (flags & CAN_REVERSE_HORIZONTAL_MOVEMENT) != 0;
+	}
+
+	inline void set_kind(bool reactive) {
+		if (vertical_movement == 0) {
+			if (horizontal_movement_start_chance != 0) {
+				kind = STEP_KIND_GENERIC;
+			} else if (reactive) {
+				kind = STEP_KIND_REACTIVE;
+			} else {
+				kind = STEP_KIND_STATIC;
+			}
+		} else if (vertical_movement < 0) {
+			kind = STEP_KIND_GAS;
+		} else if (can_reverse_horizontal_movement()) {
+			kind = STEP_KIND_LIQUID;
+		} else if (!dissipate_on_horizontal_movement()) {
+			kind = STEP_KIND_POWDER;
+		} else {
+			kind = STEP_KIND_GENERIC;
+		}
+	}
+};
+
+static_assert(sizeof(StepMaterial) == 16);
+
 #endif // CELL_MATERIAL_H
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include "core/math/vector2i.h"
 #include "grid.h"
 #include "preludes.h"
+#include <cstring>
 
 // Api for working with cells within a single chunk (center)
 // which may affect nearby chunks.
@@ -16,7 +17,14 @@ public:
 	u32 cell;
 
 	u32 cell_material_idx;
-	const CellMaterial *cell_material;
+	const StepMaterial *cell_material;
+
+	bool was_active;
+	i32 movement;
+	u32 flow;
+
+	// Step every cell with the generic kernel. See Grid::step_generic.
+	bool step_generic;
 
 	// Coord of the current cell relative to cell_coord_origin.
 	Vector2i cell_coord;
@@ -26,14 +34,20 @@ public:
 
 	Rng rng;
 
-	std::vector<std::pair<Callable *, Vector2i>> &reaction_callbacks;
+	std::vector<std::pair<CellReaction *, Vector2i>> &reaction_callbacks;
 
 	Chunk *chunks[9];
-
-	ChunkApi(Vector2i chunk_coord) :
-			cell_coord_origin((chunk_coord - Vector2i(1, 1)) * 32),
-			rng(Grid::get_temporal_rng(chunk_coord)),
-			reaction_callbacks(Grid::get_reaction_callback_vector()) {
+	// One bit per chunk written to. See Chunk::cells_changed.
+	u32 written_chunks = 0;
+
+	ChunkApi(Chunk *chunk, std::vector<std::pair<CellReaction *, Vector2i>> &reaction_callbacks) :
+			step_generic(Grid::step_generic),
+			cell_coord_origin((chunk->chunk_coord - Vector2i(1, 1)) * 32),
+			rng(Grid::get_temporal_rng(chunk->chunk_coord)),
+			reaction_callbacks(reaction_callbacks) {
+		for (i32 i = 0; i < 9; i++) {
+			chunks[i] = chunk->neighbors[i];
+		}
 	}
 
 	Chunk *center() {
@@ -60,29 +74,43 @@ public:
 		return chunk_x + chunk_y * 3;
 	}
 
+	// For writing. Materialize a uniform chunk.
 	inline u32 *get_ptr(Vector2i coord) {
 		i32 chunk_idx = to_local(coord);
+		written_chunks |= 1u << chunk_idx;
 		return chunks[chunk_idx]->get_cell_ptr(coord);
 	}
 
+	inline u32 get_cell(Vector2i coord) {
+		i32 chunk_idx = to_local(coord);
+		return chunks[chunk_idx]->get_cell(coord);
+	}
+
 	void activate_point(Vector2i coord, bool activate_cell) {
 		i32 chunk_idx = to_local(coord);
 		chunks[chunk_idx]->activate_point(coord, activate_cell);
 	}
 
-	// Does not activate the cell at coord itself.
+	// Activate the 3x3 cells around coord with one update per chunk touched, usually just one.
+	// The cell at coord is activated as a byproduct.
+	// It is always either active already or about to be overwritten.
 	void activate_neightbors(Vector2i coord) {
-		activate_point(coord + Vector2i(-1, -1), true);
-		activate_point(coord + Vector2i(0, -1), true);
-		activate_point(coord + Vector2i(1, -1), true);
-
-		activate_point(coord + Vector2i(-1, 0), true);
-		// center point is activated as a byproduct.
-		activate_point(coord + Vector2i(1, 0), true);
-
-		activate_point(coord + Vector2i(-1, 1), true);
-		activate_point(coord + Vector2i(0, 1), true);
-		activate_point(coord + Vector2i(1, 1), true);
+		bound_test(coord - Vector2i(1, 1));
+		bound_test(coord + Vector2i(1, 1));
+
+		i32 x_end = coord.x + 2;
+		i32 y_end = coord.y + 2;
+		// (v | 31) + 1 is the start of the next chunk.
+		for (i32 y = coord.y - 1; y < y_end; y = (y | 31) + 1) {
+			i32 rows_end = MIN((y | 31) + 1, y_end);
+			for (i32 x = coord.x - 1; x < x_end; x = (x | 31) + 1) {
+				i32 columns_end = MIN((x | 31) + 1, x_end);
+
+				Vector2i local_coord = Vector2i(x, y);
+				i32 chunk_idx = to_local(local_coord);
+				chunks[chunk_idx]->activate_cells(Rect2i(local_coord, Vector2i(columns_end - x, rows_end - y)));
+			}
+		}
 	}
 
 	bool is_row_active(Vector2i coord) {
@@ -92,8 +120,7 @@ public:
 
 	void try_react_between(Vector2i dir) {
 		Vector2i other_coord = cell_coord + dir;
-		u32 *other_cell_ptr = get_ptr(other_coord);
-		u32 other = *other_cell_ptr;
+		u32 other = get_cell(other_coord);
 		u32 other_material_idx = Cell::material_idx(other);
 
 		bool swap;
@@ -133,7 +160,7 @@ public:
 					} else {
 						trigger_coord += other_coord;
 					}
-					reaction_callbacks.push_back({ &reaction->callback, trigger_coord });
+					reaction_callbacks.push_back({ reaction, trigger_coord });
 				}
 
 				u32 cell_material_idx_out;
@@ -148,7 +175,7 @@ public:
 
 				if (cell_material_idx != cell_material_idx_out) {
 					cell_material_idx = cell_material_idx_out;
-					cell_material = &Grid::get_cell_material(cell_material_idx);
+					cell_material = &Grid::get_step_material(cell_material_idx);
 
 					cell = 0;
 					Cell::set_material_idx(cell, cell_material_idx);
@@ -166,12 +193,12 @@ public:
 					Cell::set_material_idx(other, other_material_idx_out);
 					Cell::set_active(other);
 
-					const CellMaterial &other_material = Grid::get_cell_material(other_material_idx_out);
+					const StepMaterial &other_material = Grid::get_step_material(other_material_idx_out);
 					if (other_material.noise_darken_max > 0) {
 						Cell::set_darken(other, rng.gen_range_u32(0, other_material.noise_darken_max));
 					}
 
-					*other_cell_ptr = other;
+					*get_ptr(other_coord) = other;
 
 					activate_neightbors(other_coord);
 				}
@@ -186,8 +213,7 @@ public:
 	// Returns true if swapped.
 	bool try_move(Vector2i dir) {
 		Vector2i other_coord = cell_coord + dir;
-		u32 *other_cell_ptr = get_ptr(other_coord);
-		u32 other = *other_cell_ptr;
+		u32 other = get_cell(other_coord);
 		u32 other_material_idx = Cell::material_idx(other);
 
 		if (other_material_idx == cell_material_idx) {
@@ -195,7 +221,7 @@ public:
 			return false;
 		}
 
-		const CellMaterial &other_material = Grid::get_cell_material(other_material_idx);
+		const StepMaterial &other_material = Grid::get_step_material(other_material_idx);
 
 		if (cell_material->density > other_material.density) {
 			// if (rng.gen_probability_u32_max(cell_material->duplicate_on_movement_chance)) {
@@ -203,6 +229,7 @@ public:
 			// 	other = cell;
 			// }
 
+			u32 *other_cell_ptr = get_ptr(other_coord);
 			*cell_ptr = other;
 			cell_ptr = other_cell_ptr;
 
@@ -220,10 +247,11 @@ public:
 
 	void step_cell(const Vector2i center_coord, const bool force_step) {
 		cell_ptr = center()->get_cell_ptr(center_coord);
+		written_chunks |= 1u << 4;
 		cell = *cell_ptr;
 		cell_coord = center_coord + Vector2i(32, 32);
 
-		bool was_active = Cell::is_active(cell);
+		was_active = Cell::is_active(cell);
 
 		if (Cell::is_updated(cell, Grid::cell_updated_bitmask)) {
 			if (was_active) {
@@ -239,22 +267,115 @@ public:
 		Cell::set_active(cell, false);
 
 		cell_material_idx = Cell::material_idx(cell);
-		cell_material = &Grid::get_cell_material(cell_material_idx);
-
-		// Reactions
-		// We react with `o`s, `x`s will react with us.
-		// x x x
-		// o @ x
-		// o o o
-		try_react_between(Vector2i(-1, 0));
-		try_react_between(Vector2i(-1, 1));
-		try_react_between(Vector2i(0, 1));
-		try_react_between(Vector2i(1, 1));
+		cell_material = &Grid::get_step_material(cell_material_idx);
+
+		switch (step_generic ? STEP_KIND_GENERIC : cell_material->kind) {
+			case STEP_KIND_STATIC:
+				step_cell_kind<STEP_KIND_STATIC>();
+				break;
+			case STEP_KIND_REACTIVE:
+				step_cell_kind<STEP_KIND_REACTIVE>();
+				break;
+			case STEP_KIND_POWDER:
+				step_cell_kind<STEP_KIND_POWDER>();
+				break;
+			case STEP_KIND_LIQUID:
+				step_cell_kind<STEP_KIND_LIQUID>();
+				break;
+			case STEP_KIND_GAS:
+				step_cell_kind<STEP_KIND_GAS>();
+				break;
+			default:
+				step_cell_kind<STEP_KIND_GENERIC>();
+				break;
+		}
+
+		Cell::set_movement(cell, movement);
+		Cell::set_flow(cell, flow);
+
+		if (Cell::is_active(cell)) {
+			Cell::set_updated(cell, Grid::cell_updated_bitmask);
+			// This is for the case where we didn't move/react, but are active nonetheless.
+			// Otherwise this does nothing as we would call activate_neightbors.
+			center()->activate_point(center_coord, false);
+		} else {
+			Cell::clear_updated(cell);
+		}
+
+		*cell_ptr = cell;
+	}
+
+	// Same result for every kind. Kinds only remove branches known from the material.
+	template <StepKind KIND>
+	void step_cell_kind() {
+		if constexpr (KIND != STEP_KIND_STATIC) {
+			// Reactions
+			// We react with `o`s, `x`s will react with us.
+			// x x x
+			// o @ x
+			// o o o
+			u32 material_idx = cell_material_idx;
+			try_react_between(Vector2i(-1, 0));
+			try_react_between(Vector2i(-1, 1));
+			try_react_between(Vector2i(0, 1));
+			try_react_between(Vector2i(1, 1));
+
+			movement = Cell::movement(cell);
+			flow = Cell::flow(cell);
+
+			if constexpr (KIND != STEP_KIND_GENERIC) {
+				if (cell_material_idx != material_idx) {
+					// This kind may not apply to the new material.
+					step_movement<STEP_KIND_GENERIC>();
+					return;
+				}
+			}
+		} else {
+			movement = Cell::movement(cell);
+			flow = Cell::flow(cell);
+		}
+
+		step_movement<KIND>();
+	}
+
+	template <StepKind KIND>
+	void step_movement() {
+		if constexpr (KIND == STEP_KIND_STATIC || KIND == STEP_KIND_REACTIVE) {
+			// Never starts moving, but may still be moving from before.
+			if (movement == -2) {
+				flow = 0;
+				return;
+			}
+			step_movement<STEP_KIND_GENERIC>();
+			return;
+		}
+
+		i32 vertical_dir;
+		if constexpr (KIND == STEP_KIND_POWDER || KIND == STEP_KIND_LIQUID) {
+			vertical_dir = 1;
+		} else if constexpr (KIND == STEP_KIND_GAS) {
+			vertical_dir = -1;
+		} else {
+			vertical_dir = SIGN(cell_material->vertical_movement);
+		}
+
+		bool can_reverse_horizontal_movement;
+		if constexpr (KIND == STEP_KIND_POWDER) {
+			can_reverse_horizontal_movement = false;
+		} else if constexpr (KIND == STEP_KIND_LIQUID) {
+			can_reverse_horizontal_movement = true;
+		} else {
+			can_reverse_horizontal_movement = cell_material->can_reverse_horizontal_movement();
+		}
+
+		bool dissipate_on_horizontal_movement;
+		if constexpr (KIND == STEP_KIND_POWDER) {
+			dissipate_on_horizontal_movement = false;
+		} else {
+			dissipate_on_horizontal_movement = cell_material->dissipate_on_horizontal_movement();
+		}
 
 		// Vertical movement
-		i32 movement = Cell::movement(cell);
-		u32 flow = Cell::flow(cell);
-		i32 vertical_dir = SIGN(cell_material->vertical_movement);
 		for (i32 i = 0; i != cell_material->vertical_movement; i += vertical_dir) {
 			if (try_move(Vector2i(0, vertical_dir))) {
 				movement = 0;
@@ -270,7 +391,10 @@ public:
 		}
 
 		// Spontaneously start moving.
-		if (was_active && movement == -2 && rng.gen_probability_u32_max(cell_material->horizontal_movement_start_chance)) {
+		if (was_active &&
+				movement == -2 &&
+				cell_material->horizontal_movement_start_chance != 0 &&
+				rng.gen_probability_u32_max(cell_material->horizontal_movement_start_chance)) {
 			movement = rng.gen_sign();
 		}
 
@@ -292,7 +416,7 @@ public:
 						continue;
 					}
 
-					if (cell_material->can_reverse_horizontal_movement) {
+					if (can_reverse_horizontal_movement) {
 						if (flow <= 1) {
 							// Try other direction.
 							movement = -movement;
@@ -315,7 +439,7 @@ public:
 					break;
 				}
 
-				if (movement != -2 && cell_material->dissipate_on_horizontal_movement) {
+				if (movement != -2 && dissipate_on_horizontal_movement) {
 					if (rng.gen_probability_u32_max(DISSIPATION_CHANCE)) {
 						// Remove this cell.
 						cell = 0;
@@ -332,37 +456,61 @@ public:
 			flow = MIN(flow, 3u);
 			Cell::set_active(cell, true);
 		}
-		Cell::set_movement(cell, movement);
-		Cell::set_flow(cell, flow);
-
-		if (Cell::is_active(cell)) {
-			Cell::set_updated(cell, Grid::cell_updated_bitmask);
-			// This is for the case where we didn't move/react, but are active nonetheless.
-			// Otherwise this does nothing as we would call activate_neightbors.
-			center()->activate_point(center_coord, false);
-		} else {
-			Cell::clear_updated(cell);
-		}
-
-		*cell_ptr = cell;
 	}
 };
 
-void Chunk::step_chunk(Vector2i chunk_coord) {
-	ChunkApi chunk_api = ChunkApi(chunk_coord);
+void Chunk::link_neighbors() {
+	neighbors[4] = this;
 
-	for (i32 y = -1; y <= 1; y++) {
-		for (i32 x = -1; x <= 1; x++) {
-			Vector2i other_chunk_coord = chunk_coord + Vector2i(x, y);
-			Chunk *chunk_ptr = Grid::get_chunk(other_chunk_coord);
+	for (i32 i = 0; i < 9; i++) {
+		if (i == 4 || neighbors[i] != nullptr) {
+			continue;
+		}
 
-			ERR_FAIL_NULL_MSG(
-					chunk_ptr,
-					"step_chunk needs it and its neighbors to exist");
+		// Compressed chunks are linked when inflated.
+		Vector2i offset = Vector2i(i % 3 - 1, i / 3 - 1);
+		Chunk *other = Grid::get_chunk_resident(chunk_coord + offset);
+		if (other == nullptr) {
+			continue;
+		}
 
-			chunk_api.chunks[(x + 1) + (y + 1) * 3] = chunk_ptr;
+		TEST_ASSERT(other->neighbors[8 - i] == nullptr, "neighbor already linked");
+
+		neighbors[i] = other;
+		num_neighbors += 1;
+		// Opposite direction.
+		other->neighbors[8 - i] = this;
+		other->num_neighbors += 1;
+	}
+}
+
+void Chunk::unlink_neighbors() {
+	for (i32 i = 0; i < 9; i++) {
+		Chunk *other = neighbors[i];
+		if (i == 4 || other == nullptr) {
+			continue;
 		}
+
+		TEST_ASSERT(other->neighbors[8 - i] == this, "neighbor not linked");
+
+		other->neighbors[8 - i] = nullptr;
+		other->num_neighbors -= 1;
+		neighbors[i] = nullptr;
 	}
+	num_neighbors = 0;
+}
+
+void Chunk::add_to_active_set() {
+	in_active_set = true;
+	Grid::add_active_chunk(chunk_coord);
+}
+
+void Chunk::step_chunk(Chunk *chunk, std::vector<std::pair<CellReaction *, Vector2i>> &reaction_callbacks) {
+	ERR_FAIL_COND_MSG(
+			!chunk->has_all_neighbors(),
+			"step_chunk needs it and its neighbors to exist");
+
+	ChunkApi chunk_api = ChunkApi(chunk, reaction_callbacks);
 
 	bool force_step = chunk_api.center()->last_step_tick <= Grid::last_modified_tick;
 	chunk_api.center()->last_step_tick = Grid::get_tick();
@@ -372,57 +520,95 @@ void Chunk::step_chunk(Vector2i chunk_coord) {
 		return;
 	}
 
-	// i32 y_start = std::countr_zero(active_rows);
-	// i32 y_end = 32 - std::countl_zero(active_rows);
+	Chunk *center = chunk_api.center();
 
-	i32 y_top;
-	i32 y_bot;
-	i32 x_start;
-	i32 x_end;
-	i32 x_step;
+	// Cells to step, one u32 per row.
+	u32 rows[32];
 	u32 active_rows;
+	// Columns between the first and last active column when the step started.
+	u32 columns;
+	i32 x_step;
 	if (force_step) {
-		y_top = -1;
-		y_bot = 31;
-		x_start = 0;
-		x_end = 32;
-		x_step = 1;
 		active_rows = MAX_U32;
+		columns = MAX_U32;
+		for (u32 y = 0; y < 32; y++) {
+			rows[y] = MAX_U32;
+		}
+		x_step = 1;
 	} else {
-		active_rows = chunk_api.center()->active_rows;
-		u32 active_columns = chunk_api.center()->active_columns;
-
-		y_top = countr_zero(active_rows) - 1;
-		y_bot = 31 - countl_zero(active_rows);
-		TEST_ASSERT(y_top < y_bot, "y_top is >= than y_top");
-
-		i32 x_start_base = countr_zero(active_columns);
-		i32 x_end_base = 32 - countl_zero(active_columns);
+		active_rows = center->active_rows;
+		std::memcpy(rows, center->active_cells, sizeof(rows));
+		columns = 0;
+		if (center->active_columns != 0) {
+			i32 x_start = countr_zero(center->active_columns);
+			i32 x_end = 32 - countl_zero(center->active_columns);
+			columns = u32((1uLL << (x_end - x_start)) - 1uLL) << x_start;
+		}
 		// Alternate iteration between left and right.
 		// Reduces visible chunk border artifacts.
-		if ((Grid::get_tick() & 1) == 0) {
-			x_step = -1;
-			x_start = x_end_base - 1;
-			x_end = x_start_base - 1;
-		} else {
-			x_step = 1;
-			x_start = x_start_base;
-			x_end = x_end_base;
-		}
+		x_step = (Grid::get_tick() & 1) == 0 ? -1 : 1;
 	}
 
-	chunk_api.center()->clear_active_rect();
+	center->clear_active_rect();
+
+	// Uniform chunks of a material which never moves or reacts stay uniform.
+	// Same result as step_cell on each cell, without materializing.
+	if (center->is_uniform()) {
+		u32 cell = center->uniform_cell.load(std::memory_order_relaxed);
+		if (Grid::get_step_material(Cell::material_idx(cell)).kind == STEP_KIND_STATIC &&
+				Cell::movement(cell) == -2 &&
+				!Cell::is_updated(cell, Grid::cell_updated_bitmask)) {
+			if (force_step || Cell::is_active(cell)) {
+				Cell::set_active(cell, false);
+				Cell::set_flow(cell, 0);
+				Cell::clear_updated(cell);
+			}
 
-	// Iterate over each cell in the chunk from the bottom.
-	for (i32 y = y_bot; y != y_top; y--) {
-		if ((active_rows & (1u << y)) == 0) {
-			continue;
+			bool every_cell = active_rows == MAX_U32;
+			for (u32 y = 0; y < 32 && every_cell; y++) {
+				every_cell = rows[y] == MAX_U32;
+			}
+
+			if (cell == center->uniform_cell.load(std::memory_order_relaxed)) {
+				return;
+			}
+			if (every_cell) {
+				center->uniform_cell.store(cell, std::memory_order_relaxed);
+				center->cells_changed();
+				return;
+			}
 		}
+	}
 
-		i32 x = x_start;
-		while (x != x_end) {
-			chunk_api.step_cell(Vector2i(x, y), force_step);
-			x += x_step;
+	// Iterate over each active cell in the chunk from the bottom.
+	while (active_rows != 0) {
+		i32 y = 31 - countl_zero(active_rows);
+		active_rows &= ~(1u << y);
+
+		// Cells further in this row activated while stepping are stepped too,
+		// but only within the starting columns, like a scan of them would.
+		u32 pending = rows[y];
+		if (x_step == 1) {
+			while (pending != 0) {
+				i32 x = countr_zero(pending);
+				chunk_api.step_cell(Vector2i(x, y), force_step);
+				// Bits after x. 2u << 31 overflows to 0, which keeps no bit.
+				pending = (pending | (center->active_cells[y] & columns)) & ~((2u << x) - 1u);
+			}
+		} else {
+			while (pending != 0) {
+				i32 x = 31 - countl_zero(pending);
+				chunk_api.step_cell(Vector2i(x, y), force_step);
+				// Bits before x.
+				pending = (pending | (center->active_cells[y] & columns)) & ((1u << x) - 1u);
+			}
 		}
 	}
-}
\ No newline at end of file
+
+	// Once every cell is written, so a reader never sees the new version with old cells.
+	while (chunk_api.written_chunks != 0) {
+		i32 chunk_idx = countr_zero(chunk_api.written_chunks);
+		chunk_api.written_chunks &= chunk_api.written_chunks - 1;
+		chunk_api.chunks[chunk_idx]->cells_changed();
+	}
+}
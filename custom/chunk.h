@@ -1,42 +1,96 @@
 #ifndef CHUNK_HPP
 #define CHUNK_HPP
 
+#include "background.hpp"
 #include "cell.hpp"
 #include "core/math/rect2i.h"
 #include "core/math/vector2.h"
 #include "core/math/vector2i.h"
+#include "pool.hpp"
 #include "preludes.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+struct CellReaction;
 
 // Coord is relative to first cell (top left).
-class Chunk {
+// Stored in a Region.
+class alignas(64) Chunk {
 public:
+	// For cells and cells_save.
+	inline static BlockPool<32 * 32 * sizeof(u32), 64> buffer_pool = {};
+	// High bits of the next cells_version.
+	inline static std::atomic<u64> next_cells_epoch = 1;
+
+	// Unique high bits, so a recreated chunk never matches an older version.
+	inline static u64 new_cells_version() {
+		return next_cells_epoch.fetch_add(1, std::memory_order_relaxed) << 32;
+	}
+
 	Vector2i chunk_coord;
 
 	i64 last_step_tick = -1;
 
+	// Changed after every write to cells or background. Never 0.
+	// Read without locking while stepping, see cells_changed.
+	std::atomic<u64> cells_version = new_cells_version();
+
 	u32 active_rows = MAX_U32;
 	u32 active_columns = MAX_U32;
+	// One bit per cell to step, one u32 per row.
+	// Set by every activate method, so it covers every active cell.
+	u32 active_cells[32] = {
+		MAX_U32, MAX_U32, MAX_U32, MAX_U32, MAX_U32, MAX_U32, MAX_U32, MAX_U32,
+		MAX_U32, MAX_U32, MAX_U32, MAX_U32, MAX_U32, MAX_U32, MAX_U32, MAX_U32,
+		MAX_U32, MAX_U32, MAX_U32, MAX_U32, MAX_U32, MAX_U32, MAX_U32, MAX_U32,
+		MAX_U32, MAX_U32, MAX_U32, MAX_U32, MAX_U32, MAX_U32, MAX_U32, MAX_U32
+	};
 
 	u32 num_background_cell = 0;
-	u32 *background = nullptr;
+	// Number of non-null neighbors, excluding this chunk.
+	u32 num_neighbors = 0;
+
+	Background background = {};
 
 	u32 *cells_save = nullptr;
 
-	u32 cells[32 * 32];
+	// Null while uniform.
+	// Allocated on first write, so all-air or all-solid chunks never allocate.
+	// Grid::read_chunk_layers may read it while stepping, so it is published with a release store
+	// once filled and retired instead of freed.
+	// The thread writing cells loads it relaxed.
+	std::atomic<u32 *> cells = nullptr;
+	// Value of every cell while uniform. Atomic for the same reason as cells.
+	std::atomic<u32> uniform_cell = 0;
+
+	// Created by Grid::prepare_step_rects and not generated yet.
+	bool needs_generation = false;
+	// In Grid's active chunks. Cleared when Grid takes it out to step it.
+	bool in_active_set = false;
+
+	// Chunks around this chunk, row-major with this chunk at index 4.
+	// Null when a neighbor does not exist.
+	// Kept in sync by `link_neighbors` and `unlink_neighbors`.
+	Chunk *neighbors[9] = {};
+
+	inline bool has_all_neighbors() {
+		return num_neighbors == 8;
+	}
 
-	// Align to cache line on 64bit target.
-	u32 _padding[4];
+	// Find the existing resident neighbors in Grid and link them both ways.
+	// Called after this chunk is added to Grid or inflated.
+	void link_neighbors();
 
-	inline i64 get_memory_usage() {
-		i64 mem = sizeof(Chunk);
-		if (background != nullptr) {
-			mem += 32 * 32 * sizeof(u32);
-		}
-		if (cells_save != nullptr) {
-			mem += 32 * 32 * sizeof(u32);
-		}
-		return mem;
-	}
+	// Remove this chunk from its neighbors.
+	// Needs to be called before removing this chunk from Grid.
+	void unlink_neighbors();
+
+	// Add this chunk to Grid's active chunks if it is not already there.
+	// Called by every activate method, so a chunk flipping from inactive is never missed.
+	void add_to_active_set();
 
 	inline bool is_inactive() {
 		return active_rows == 0;
@@ -68,58 +122,114 @@ public:
 		TEST_ASSERT(coord.y < 32, "coord.y is too large");
 	}
 
+	inline bool is_uniform() {
+		return cells.load(std::memory_order_relaxed) == nullptr;
+	}
+
+	// Allocate cells filled with uniform_cell. Does nothing if already allocated.
+	inline void materialize() {
+		if (!is_uniform()) {
+			return;
+		}
+
+		// Filled before being visible to readers.
+		u32 *new_cells = reinterpret_cast<u32 *>(buffer_pool.alloc());
+		std::fill_n(new_cells, 32 * 32, uniform_cell.load(std::memory_order_relaxed));
+		cells.store(new_cells, std::memory_order_release);
+	}
+
+	// Set every cell to the same value and free cells.
+	// Does not modify active rect.
+	inline void fill(u32 cell) {
+		// A reader seeing the null cells also sees the new uniform_cell.
+		uniform_cell.store(cell, std::memory_order_relaxed);
+		u32 *old_cells = cells.exchange(nullptr, std::memory_order_release);
+		if (old_cells != nullptr) {
+			buffer_pool.retire(old_cells);
+		}
+		cells_changed();
+	}
+
+	// Call once done writing cells or background.
+	// A reader which sees the new version also sees the writes before it.
+	inline void cells_changed() {
+		cells_version.fetch_add(1, std::memory_order_release);
+	}
+
+	// For writing. Materialize a uniform chunk.
+	// Call cells_changed once done writing.
 	inline u32 *get_cell_ptr(Vector2i coord) {
 		bound_test(coord);
-		return cells + coord.x + coord.y * 32;
+		materialize();
+		return cells.load(std::memory_order_relaxed) + coord.x + coord.y * 32;
 	}
 
 	inline u32 get_cell(Vector2i coord) {
-		return *get_cell_ptr(coord);
+		bound_test(coord);
+		u32 *cells_ptr = cells.load(std::memory_order_relaxed);
+		if (cells_ptr == nullptr) {
+			return uniform_cell.load(std::memory_order_relaxed);
+		}
+		return cells_ptr[coord.x + coord.y * 32];
 	}
 
 	// Does not modify active rect.
 	inline void set_cell(Vector2i coord, u32 cell) {
+		if (is_uniform() && cell == uniform_cell.load(std::memory_order_relaxed)) {
+			return;
+		}
 		*get_cell_ptr(coord) = cell;
+		cells_changed();
 	}
 
 	inline u32 get_background(Vector2i coord) {
 		bound_test(coord);
-		if (background == nullptr) {
-			return 0;
-		} else {
-			return background[coord.x + coord.y * 32];
-		}
+		return background.get(coord.x + coord.y * 32);
 	}
 
 	inline void set_background(Vector2i coord, u32 cell) {
 		bound_test(coord);
-		if (background == nullptr) {
-			if (cell == 0) {
-				return;
-			} else {
-				background = new u32[32 * 32]{};
-			}
+		u32 i = coord.x + coord.y * 32;
+
+		u32 old = background.get(i);
+		if (old == cell) {
+			return;
 		}
 
-		u32 &ptr = background[coord.x + coord.y * 32];
-		if (ptr != 0) {
+		if (old != 0) {
 			num_background_cell -= 1;
 		}
-
-		ptr = cell;
 		if (cell != 0) {
 			num_background_cell += 1;
 		}
+
+		background.set(i, cell);
+		cells_changed();
 	}
 
 	inline void activate_all(bool activate_cells) {
+		if (!in_active_set) {
+			add_to_active_set();
+		}
+
 		active_rows = MAX_U32;
 		active_columns = MAX_U32;
+		for (u32 y = 0; y < 32; y++) {
+			active_cells[y] = MAX_U32;
+		}
 
 		if (activate_cells) {
-			for (u32 i = 0; i < 32 * 32; i++) {
-				Cell::set_active(cells[i]);
+			u32 *cells_ptr = cells.load(std::memory_order_relaxed);
+			if (cells_ptr == nullptr) {
+				u32 cell = uniform_cell.load(std::memory_order_relaxed);
+				Cell::set_active(cell);
+				uniform_cell.store(cell, std::memory_order_relaxed);
+			} else {
+				for (u32 i = 0; i < 32 * 32; i++) {
+					Cell::set_active(cells_ptr[i]);
+				}
 			}
+			cells_changed();
 		}
 	}
 
@@ -130,40 +240,92 @@ public:
 		bound_test(rect.position);
 		bound_test(rect.get_end() - Vector2i(1, 1));
 
+		if (!in_active_set) {
+			add_to_active_set();
+		}
+
+		u32 columns = u32((1uLL << rect.size.x) - 1uLL) << rect.position.x;
 		active_rows |= u32((1uLL << rect.size.y) - 1uLL) << rect.position.y;
-		active_columns |= u32((1uLL << rect.size.x) - 1uLL) << rect.position.x;
+		active_columns |= columns;
+		for (i32 y = rect.position.y; y < rect.get_end().y; y++) {
+			active_cells[y] |= columns;
+		}
+	}
+
+	// Same as activate_rect, but also set cells to activated.
+	inline void activate_cells(Rect2i rect) {
+		activate_rect(rect);
+
+		materialize();
+		u32 *cells_ptr = cells.load(std::memory_order_relaxed);
+		for (i32 y = rect.position.y; y < rect.get_end().y; y++) {
+			for (i32 x = rect.position.x; x < rect.get_end().x; x++) {
+				Cell::set_active(cells_ptr[x + y * 32]);
+			}
+		}
+		cells_changed();
 	}
 
 	inline void activate_point(Vector2i coord, bool activate_cell) {
 		bound_test(coord);
 
+		if (!in_active_set) {
+			add_to_active_set();
+		}
+
 		active_rows |= 1u << coord.y;
 		active_columns |= 1u << coord.x;
+		active_cells[coord.y] |= 1u << coord.x;
 
 		if (activate_cell) {
-			Cell::set_active(cells[coord.x + coord.y * 32]);
+			Cell::set_active(*get_cell_ptr(coord));
+			cells_changed();
 		}
 	}
 
 	inline void clear_active_rect() {
 		active_rows = 0;
 		active_columns = 0;
+		for (u32 y = 0; y < 32; y++) {
+			active_cells[y] = 0;
+		}
 	}
 
-	// Needs chunk and its 8 neighbors to exist in Grid::chunks,
-	static void step_chunk(Vector2i chunk_coord);
+	// Mark every cell within the active rect as active.
+	// For when only the active rect is known.
+	inline void fill_active_cells() {
+		u32 columns = 0;
+		if (active_columns != 0) {
+			i32 x_start = countr_zero(active_columns);
+			i32 x_end = 32 - countl_zero(active_columns);
+			columns = u32((1uLL << (x_end - x_start)) - 1uLL) << x_start;
+		}
+		for (u32 y = 0; y < 32; y++) {
+			active_cells[y] = is_row_active(y) ? columns : 0;
+		}
+	}
+
+	// Needs chunk and its 8 neighbors to exist in Grid.
+	// Triggered reaction callbacks are added to reaction_callbacks.
+	static void step_chunk(Chunk *chunk, std::vector<std::pair<CellReaction *, Vector2i>> &reaction_callbacks);
+
+	inline void free_background() {
+		background.free();
+		num_background_cell = 0;
+	}
 
 	~Chunk() {
-		if (background != nullptr) {
-			delete[] background;
+		u32 *cells_ptr = cells.load(std::memory_order_relaxed);
+		if (cells_ptr != nullptr) {
+			buffer_pool.retire(cells_ptr);
 		}
+		free_background();
 		if (cells_save != nullptr) {
-			delete[] cells_save;
+			buffer_pool.free(cells_save);
 		}
 	}
 };
 
-// static_assert(sizeof(Chunk) == 4160);
-// static_assert(sizeof(Chunk) % 64 == 0, "Alignment to cache line");
+static_assert(sizeof(Chunk) % 64 == 0, "Alignment to cache line");
 
 #endif
\ No newline at end of file
@@ -0,0 +1,295 @@
+#ifndef CHUNK_TABLE_HPP
+#define CHUNK_TABLE_HPP
+
+#include "preludes.h"
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CHUNK_TABLE_SSE2
+#include <emmintrin.h>
+#endif
+
+// Open addressing hash map from `Grid::chunk_id` to a pointer (swiss table style).
+// Also used for region ids.
+//
+// Each slot has a control byte which is either empty, deleted or
+// the low 7 bits of the key's hash. Slots are probed by aligned groups of 16:
+// all control bytes of a group are compared at once (sse2 when available)
+// and keys are only compared on a control byte match.
+//
+// Only pointers are stored, so what they point to never moves
+// when the table grows. Pointers returned by `get` stay valid until erased.
+template <typename T>
+class ChunkTable {
+	static constexpr u64 GROUP_SIZE = 16;
+
+	static constexpr u8 CTRL_EMPTY = 0x80;
+	static constexpr u8 CTRL_DELETED = 0xFE;
+
+	struct Slot {
+		u64 key;
+		T *value;
+	};
+
+	// One per slot. Groups are aligned,
+	// so the first group doesn't need to be mirrored at the end.
+	u8 *ctrl = nullptr;
+	Slot *slots = nullptr;
+
+	// Power of 2 and multiple of GROUP_SIZE, or 0.
+	u64 capacity = 0;
+	u64 num_items = 0;
+	// How many empty slots can be filled before needing to rehash.
+	u64 growth_left = 0;
+
+	inline static u64 hash(u64 key) {
+		key ^= key >> 33;
+		key *= 0xff51afd7ed558ccduLL;
+		key ^= key >> 33;
+		return key;
+	}
+
+	inline static u8 h2(u64 hash) {
+		return u8(hash & 0x7F);
+	}
+
+	inline static u64 max_load(u64 capacity) {
+		return capacity - capacity / 8;
+	}
+
+	// Bitmask of the slots in the group whose control byte is `value`.
+	inline static u32 group_match(const u8 *group, u8 value) {
+#ifdef CHUNK_TABLE_SSE2
+		__m128i ctrls = _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+		return u32(_mm_movemask_epi8(_mm_cmpeq_epi8(ctrls, _mm_set1_epi8(char(value)))));
+#else
+		u32 mask = 0;
+		for (u64 i = 0; i < GROUP_SIZE; i++) {
+			mask |= u32(group[i] == value) << i;
+		}
+		return mask;
+#endif
+	}
+
+	// Empty and deleted are the only control bytes with the high bit set.
+	inline static u32 group_match_empty_or_deleted(const u8 *group) {
+#ifdef CHUNK_TABLE_SSE2
+		__m128i ctrls = _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+		return u32(_mm_movemask_epi8(ctrls));
+#else
+		u32 mask = 0;
+		for (u64 i = 0; i < GROUP_SIZE; i++) {
+			mask |= u32(group[i] >> 7) << i;
+		}
+		return mask;
+#endif
+	}
+
+	// Return the slot idx of key or -1 if not found.
+	inline i64 find(u64 key) const {
+		if (capacity == 0) {
+			return -1;
+		}
+
+		u64 hash_value = hash(key);
+		u8 ctrl_value = h2(hash_value);
+		u64 num_groups_mask = capacity / GROUP_SIZE - 1;
+		u64 group_idx = (hash_value >> 7) & num_groups_mask;
+
+		// Triangular probing visits every group when the number of groups is a power of 2.
+		for (u64 i = 1;; i++) {
+			const u8 *group = ctrl + group_idx * GROUP_SIZE;
+
+			u32 mask = group_match(group, ctrl_value);
+			while (mask != 0) {
+				u64 slot_idx = group_idx * GROUP_SIZE + u64(countr_zero(mask));
+				if (slots[slot_idx].key == key) {
+					return i64(slot_idx);
+				}
+				mask &= mask - 1;
+			}
+
+			if (group_match(group, CTRL_EMPTY) != 0) {
+				return -1;
+			}
+
+			group_idx = (group_idx + i) & num_groups_mask;
+		}
+	}
+
+	// Return the first empty or deleted slot along key's probe sequence.
+	// Table needs to have at least one empty slot.
+	inline u64 find_insert_slot(u64 hash_value) const {
+		u64 num_groups_mask = capacity / GROUP_SIZE - 1;
+		u64 group_idx = (hash_value >> 7) & num_groups_mask;
+
+		for (u64 i = 1;; i++) {
+			u32 mask = group_match_empty_or_deleted(ctrl + group_idx * GROUP_SIZE);
+			if (mask != 0) {
+				return group_idx * GROUP_SIZE + u64(countr_zero(mask));
+			}
+
+			group_idx = (group_idx + i) & num_groups_mask;
+		}
+	}
+
+	void rehash(u64 new_capacity) {
+		TEST_ASSERT(new_capacity % GROUP_SIZE == 0, "capacity is not a multiple of GROUP_SIZE");
+		TEST_ASSERT((new_capacity & (new_capacity - 1)) == 0, "capacity is not a power of 2");
+		TEST_ASSERT(max_load(new_capacity) > num_items, "capacity is too small");
+
+		u8 *old_ctrl = ctrl;
+		Slot *old_slots = slots;
+		u64 old_capacity = capacity;
+
+		ctrl = new u8[new_capacity];
+		std::memset(ctrl, CTRL_EMPTY, new_capacity);
+		slots = new Slot[new_capacity];
+		capacity = new_capacity;
+		growth_left = max_load(new_capacity) - num_items;
+
+		for (u64 i = 0; i < old_capacity; i++) {
+			if ((old_ctrl[i] & 0x80) == 0) {
+				u64 hash_value = hash(old_slots[i].key);
+				u64 slot_idx = find_insert_slot(hash_value);
+				ctrl[slot_idx] = h2(hash_value);
+				slots[slot_idx] = old_slots[i];
+			}
+		}
+
+		delete[] old_ctrl;
+		delete[] old_slots;
+	}
+
+public:
+	struct Iterator {
+		const ChunkTable *table;
+		u64 slot_idx;
+
+		inline void skip_to_full() {
+			while (slot_idx < table->capacity && (table->ctrl[slot_idx] & 0x80) != 0) {
+				slot_idx += 1;
+			}
+		}
+
+		inline T *operator*() const {
+			return table->slots[slot_idx].value;
+		}
+
+		inline Iterator &operator++() {
+			slot_idx += 1;
+			skip_to_full();
+			return *this;
+		}
+
+		inline bool operator!=(const Iterator &other) const {
+			return slot_idx != other.slot_idx;
+		}
+	};
+
+	// Return nullptr if not found.
+	inline T *get(u64 key) const {
+		i64 slot_idx = find(key);
+		if (slot_idx < 0) {
+			return nullptr;
+		} else {
+			return slots[slot_idx].value;
+		}
+	}
+
+	// Return a pointer to the new value to fill or
+	// nullptr if key is already in the table.
+	// Returned pointer is invalidated by the next insert.
+	inline T **try_insert(u64 key) {
+		if (find(key) >= 0) {
+			return nullptr;
+		}
+
+		if (capacity == 0) {
+			rehash(GROUP_SIZE);
+		}
+
+		u64 hash_value = hash(key);
+		u64 slot_idx = find_insert_slot(hash_value);
+
+		if (growth_left == 0 && ctrl[slot_idx] == CTRL_EMPTY) {
+			// Reuse the same capacity if it is mostly filled with deleted slots.
+			if (num_items * 2 < max_load(capacity)) {
+				rehash(capacity);
+			} else {
+				rehash(capacity * 2);
+			}
+			slot_idx = find_insert_slot(hash_value);
+		}
+
+		if (ctrl[slot_idx] == CTRL_EMPTY) {
+			growth_left -= 1;
+		}
+		ctrl[slot_idx] = h2(hash_value);
+		slots[slot_idx].key = key;
+		slots[slot_idx].value = nullptr;
+		num_items += 1;
+
+		return &slots[slot_idx].value;
+	}
+
+	// Return true if key was in the table.
+	inline bool erase(u64 key) {
+		i64 slot_idx = find(key);
+		if (slot_idx < 0) {
+			return false;
+		}
+
+		// A probe sequence stops at the first group with an empty slot,
+		// so no key can be past this group if it already had one.
+		u8 *group = ctrl + (u64(slot_idx) & ~(GROUP_SIZE - 1));
+		if (group_match(group, CTRL_EMPTY) != 0) {
+			ctrl[slot_idx] = CTRL_EMPTY;
+			growth_left += 1;
+		} else {
+			ctrl[slot_idx] = CTRL_DELETED;
+		}
+		num_items -= 1;
+
+		return true;
+	}
+
+	// Also free memory.
+	inline void clear() {
+		delete[] ctrl;
+		delete[] slots;
+		ctrl = nullptr;
+		slots = nullptr;
+		capacity = 0;
+		num_items = 0;
+		growth_left = 0;
+	}
+
+	inline u64 size() const {
+		return num_items;
+	}
+
+	inline i64 get_memory_usage() const {
+		return i64(capacity * (sizeof(u8) + sizeof(Slot)));
+	}
+
+	inline Iterator begin() const {
+		Iterator it = { this, 0 };
+		it.skip_to_full();
+		return it;
+	}
+
+	inline Iterator end() const {
+		return { this, capacity };
+	}
+
+	ChunkTable() {}
+	ChunkTable(const ChunkTable &) = delete;
+	ChunkTable &operator=(const ChunkTable &) = delete;
+
+	~ChunkTable() {
+		clear();
+	}
+};
+
+#endif
@@ -1,4 +1,5 @@
 #include "grid.h"
+#include "background.hpp"
 #include "biome.h"
 #include "cell.hpp"
 #include "cell_material.hpp"
@@ -10,8 +11,10 @@
 #include "core/math/vector2i.h"
 #include "core/object/class_db.h"
 #include "core/object/ref_counted.h"
+#include "core/object/worker_thread_pool.h"
 #include "core/os/memory.h"
 #include "core/os/mutex.h"
+#include "core/os/spin_lock.h"
 #include "core/string/print_string.h"
 #include "core/templates/vector.h"
 #include "core/variant/array.h"
@@ -20,13 +23,44 @@
 #include "preludes.h"
 #include "rng.hpp"
 #include <algorithm>
+#include <atomic>
 #include <cstring>
-#include <unordered_map>
 #include <utility>
 #include <vector>
 
-inline static std::unordered_map<Thread::ID, std::vector<std::pair<Callable *, Vector2i>>> thread_vectors = {};
-inline static Mutex thread_vectors_mutex = Mutex();
+// Region coords touching rects grown by 1.
+static std::vector<Rect2i> keep_region_rects(const TypedArray<Rect2i> &keep_rects) {
+	std::vector<Rect2i> region_rects = {};
+	region_rects.reserve(keep_rects.size());
+	for (i32 i = 0; i < keep_rects.size(); i++) {
+		Rect2i rect = keep_rects[i];
+		if (rect.has_area()) {
+			// Chunks stepped need their neighbors.
+			Vector2i start = Region::to_region_coord(rect.position - Vector2i(1, 1));
+			Vector2i end = Region::to_region_coord(rect.get_end());
+			region_rects.push_back(Rect2i(start, end - start + Vector2i(1, 1)));
+		}
+	}
+	return region_rects;
+}
+
+static bool is_region_kept(const std::vector<Rect2i> &region_rects, Region *region) {
+	for (const Rect2i &rect : region_rects) {
+		if (rect.has_point(region->region_coord)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool rects_have_point(const std::vector<Rect2i> &rects, Vector2i point) {
+	for (const Rect2i &rect : rects) {
+		if (rect.has_point(point)) {
+			return true;
+		}
+	}
+	return false;
+}
 
 u32 reations_key(const u32 m1, const u32 m2, bool &swap) {
 	if (m1 <= m2) {
@@ -38,6 +72,53 @@ u32 reations_key(const u32 m1, const u32 m2, bool &swap) {
 	}
 }
 
+// Chunks stepped one after the other by a single task.
+struct StepColumn {
+	i32 x;
+	// Step order of the first chunk.
+	u32 first_order;
+	// From bottom to top.
+	std::vector<Chunk *> chunks;
+};
+
+// Chunks of step_rects where each chunk is its own task.
+// A chunk waits on the earlier chunks whose 3x3 neighborhood overlaps its own,
+// so the result is the same as stepping them one after the other.
+struct StepGraph {
+	// In step order.
+	std::vector<Chunk *> chunks;
+	// Step order of the first chunk.
+	u32 first_order;
+	// Number of chunks each chunk still waits on.
+	std::vector<u32> num_dependencies;
+	// Chunks waiting on chunk i are dependents[dependents_start[i]..dependents_start[i + 1]].
+	std::vector<u32> dependents_start;
+	std::vector<u32> dependents;
+
+	BinaryMutex mutex;
+	// Chunks with no dependency left.
+	std::vector<u32> ready;
+	u32 num_remaining;
+	// Tasks started, to be waited on.
+	std::vector<WorkerThreadPool::TaskID> tasks;
+	// Tasks started and not returned, up to max_tasks.
+	u32 num_running;
+	u32 max_tasks;
+	// Reaction arenas not used by a running task.
+	std::vector<u32> free_arenas;
+};
+
+// Rect of get_cell_buffer split in rows of chunks.
+struct CellBufferBands {
+	Rect2i rect;
+	bool clean;
+	u32 *buffer;
+	u32 *background_buffer;
+	// Chunk coord of the first band.
+	Vector2i chunk_start;
+	i32 chunk_end_x;
+};
+
 i32 get_slice_idx(i32 x) {
 	return div_floor(x + (GENERATION_SLICE_CHUNK_SIZE / 2), GENERATION_SLICE_CHUNK_SIZE);
 }
@@ -58,8 +139,9 @@ void Grid::_bind_methods() {
 			&Grid::clear_cell_reactions);
 	ClassDB::bind_static_method(
 			"Grid",
-			D_METHOD("add_cell_reaction", "in1", "in2", "out1", "out2", "probability", "callback"),
-			&Grid::add_cell_reaction);
+			D_METHOD("add_cell_reaction", "in1", "in2", "out1", "out2", "probability", "callback", "batch_callback"),
+			&Grid::add_cell_reaction,
+			DEFVAL(false));
 	ClassDB::bind_static_method(
 			"Grid",
 			D_METHOD("remove_cell_reaction", "reaction_id"),
@@ -100,11 +182,21 @@ void Grid::_bind_methods() {
 			"Grid",
 			D_METHOD("get_grid_memory_usage"),
 			&Grid::get_grid_memory_usage);
+	ClassDB::bind_static_method(
+			"Grid",
+			D_METHOD("get_grid_memory_stats"),
+			&Grid::get_grid_memory_stats);
 
 	ClassDB::bind_static_method(
 			"Grid",
-			D_METHOD("get_cell_buffer", "rect", "background", "clean"),
-			&Grid::get_cell_buffer);
+			D_METHOD("get_cell_buffer", "rect", "background", "clean", "num_threads"),
+			&Grid::get_cell_buffer,
+			DEFVAL(1));
+	ClassDB::bind_static_method(
+			"Grid",
+			D_METHOD("get_cell_buffers", "rect", "clean", "num_threads"),
+			&Grid::get_cell_buffers,
+			DEFVAL(1));
 
 	ClassDB::bind_static_method(
 			"Grid",
@@ -153,10 +245,65 @@ void Grid::_bind_methods() {
 			"Grid",
 			D_METHOD("try_create_chunk", "chunk_coord"),
 			&Grid::try_create_chunk);
+
+	ClassDB::bind_static_method(
+			"Grid",
+			D_METHOD("set_unload_chunk_callback", "callback"),
+			&Grid::set_unload_chunk_callback);
+	ClassDB::bind_static_method(
+			"Grid",
+			D_METHOD("set_memory_budget", "bytes"),
+			&Grid::set_memory_budget);
+	ClassDB::bind_static_method(
+			"Grid",
+			D_METHOD("get_memory_budget"),
+			&Grid::get_memory_budget);
+	ClassDB::bind_static_method(
+			"Grid",
+			D_METHOD("unload_old_chunks", "keep_rects"),
+			&Grid::unload_old_chunks);
+	ClassDB::bind_static_method(
+			"Grid",
+			D_METHOD("set_compress_after_ticks", "value"),
+			&Grid::set_compress_after_ticks);
+	ClassDB::bind_static_method(
+			"Grid",
+			D_METHOD("get_compress_after_ticks"),
+			&Grid::get_compress_after_ticks);
+	ClassDB::bind_static_method(
+			"Grid",
+			D_METHOD("compress_old_chunks", "keep_rects"),
+			&Grid::compress_old_chunks);
 	ClassDB::bind_static_method(
 			"Grid",
 			D_METHOD("step_chunk", "chunk_coord"),
 			&Grid::step_chunk);
+	ClassDB::bind_static_method(
+			"Grid",
+			D_METHOD("set_generate_chunk_callback", "callback"),
+			&Grid::set_generate_chunk_callback);
+	ClassDB::bind_static_method(
+			"Grid",
+			D_METHOD("prepare_step_rects", "rects"),
+			&Grid::prepare_step_rects);
+	ClassDB::bind_static_method(
+			"Grid",
+			D_METHOD("step_rects", "rects"),
+			&Grid::step_rects);
+	ClassDB::bind_static_method(
+			"Grid",
+			D_METHOD("step_active_rects", "rects", "max_chunks", "priority_rects"),
+			&Grid::step_active_rects,
+			DEFVAL(0),
+			DEFVAL(TypedArray<Rect2i>()));
+	ClassDB::bind_static_method(
+			"Grid",
+			D_METHOD("get_num_deferred_chunks"),
+			&Grid::get_num_deferred_chunks);
+	ClassDB::bind_static_method(
+			"Grid",
+			D_METHOD("get_num_active_chunks"),
+			&Grid::get_num_active_chunks);
 	ClassDB::bind_static_method(
 			"Grid",
 			D_METHOD("pre_step"),
@@ -165,6 +312,27 @@ void Grid::_bind_methods() {
 			"Grid",
 			D_METHOD("post_step"),
 			&Grid::post_step);
+	ClassDB::bind_static_method(
+			"Grid",
+			D_METHOD("start_step", "step"),
+			&Grid::start_step);
+	ClassDB::bind_static_method(
+			"Grid",
+			D_METHOD("is_step_running"),
+			&Grid::is_step_running);
+	ClassDB::bind_static_method(
+			"Grid",
+			D_METHOD("try_finish_step", "tick_waiting"),
+			&Grid::try_finish_step,
+			DEFVAL(true));
+	ClassDB::bind_static_method(
+			"Grid",
+			D_METHOD("finish_step"),
+			&Grid::finish_step);
+	ClassDB::bind_static_method(
+			"Grid",
+			D_METHOD("get_step_stats"),
+			&Grid::get_step_stats);
 
 	ClassDB::bind_static_method(
 			"Grid",
@@ -221,34 +389,64 @@ void Grid::_bind_methods() {
 	BIND_ENUM_CONSTANT(CELL_COLLISION_LIQUID);
 }
 
-std::vector<std::pair<Callable *, Vector2i>> &Grid::get_reaction_callback_vector() {
-	Thread::ID id = Thread::get_caller_id();
+void Grid::add_active_chunk(Vector2i chunk_coord) {
+	active_chunks_lock.lock();
+	active_chunks.push_back(chunk_coord);
+	active_chunks_lock.unlock();
+}
 
-	thread_vectors_mutex.lock();
-	auto &vec = thread_vectors[id];
-	thread_vectors_mutex.unlock();
+void Grid::prune_active_chunks() {
+	// in_active_set is cleared on the first entry of a chunk, so later ones are dropped.
+	std::vector<Chunk *> kept_chunks = {};
+	u64 num_kept = 0;
+	for (Vector2i chunk_coord : active_chunks) {
+		Chunk *chunk = get_chunk_resident(chunk_coord);
+		if (chunk == nullptr || !chunk->in_active_set) {
+			continue;
+		}
+		chunk->in_active_set = false;
+		kept_chunks.push_back(chunk);
+		active_chunks[num_kept] = chunk_coord;
+		num_kept += 1;
+	}
+	active_chunks.resize(num_kept);
 
-	return vec;
+	for (Chunk *chunk : kept_chunks) {
+		chunk->in_active_set = true;
+	}
 }
 
-void Grid::reactions_between(
-		CellReaction *&start,
-		CellReaction *&end,
-		u32 m1,
-		u32 m2,
-		bool &swap) {
-	u32 reactions_key = reations_key(
-			m1,
-			m2,
-			swap);
+void Grid::build_reaction_table() {
+	if (!reaction_table_dirty) {
+		return;
+	}
+	reaction_table_dirty = false;
+
+	num_reaction_materials = u32(cell_materials.size());
+	reaction_table.clear();
+	reaction_spans.assign(u64(num_reaction_materials) * u64(num_reaction_materials), { 0, 0 });
+	reactive_materials.assign((num_reaction_materials + 63) / 64, 0);
 
-	if (auto it = cell_reactions.find(reactions_key); it != cell_reactions.end()) {
-		auto v = &it->second;
-		start = v->data();
-		end = start + v->size();
-	} else {
-		start = nullptr;
-		end = nullptr;
+	// Map iteration order does not matter as each pair has its own span.
+	for (auto &[key, reactions] : cell_reactions) {
+		u32 m1 = key & 0xFFFF;
+		u32 m2 = key >> 16;
+		if (reactions.empty() || m2 >= num_reaction_materials) {
+			continue;
+		}
+
+		u32 start = u32(reaction_table.size());
+		reaction_table.insert(reaction_table.end(), reactions.begin(), reactions.end());
+		reaction_spans[m1 * num_reaction_materials + m2] = { start, u32(reaction_table.size()) };
+
+		reactive_materials[m1 >> 6] |= 1uLL << (m1 & 63);
+		reactive_materials[m2 >> 6] |= 1uLL << (m2 & 63);
+	}
+
+	// Unknown materials never react.
+	for (u32 i = 0; i < 4096; i++) {
+		bool reactive = i < num_reaction_materials && (reactive_materials[i >> 6] & (1uLL << (i & 63))) != 0;
+		step_materials[i].set_kind(reactive);
 	}
 }
 
@@ -275,26 +473,217 @@ u64 Grid::chunk_id(Vector2i chunk_coord) {
 }
 
 Chunk *Grid::get_chunk(Vector2i chunk_coord) {
-	if (auto it = chunks.find(chunk_id(chunk_coord)); it != chunks.end()) {
-		return it->second;
-	} else {
+	Region *region = regions.get(chunk_id(Region::to_region_coord(chunk_coord)));
+	if (region == nullptr) {
 		return nullptr;
 	}
+
+	u32 slot = Region::to_slot(chunk_coord);
+	if (!region->is_occupied(slot)) {
+		return nullptr;
+	}
+
+	Chunk *block = region->chunks.load(std::memory_order_acquire);
+	if (block == nullptr) {
+		block = inflate_region(region);
+	}
+	return block + slot;
+}
+
+Region *Grid::get_region(Vector2i chunk_coord) {
+	return regions.get(chunk_id(Region::to_region_coord(chunk_coord)));
+}
+
+Chunk *Grid::get_chunk_resident(Vector2i chunk_coord) {
+	Region *region = regions.get(chunk_id(Region::to_region_coord(chunk_coord)));
+	if (region == nullptr) {
+		return nullptr;
+	}
+	return region->get_chunk(Region::to_slot(chunk_coord));
+}
+
+Chunk *Grid::inflate_region(Region *region) {
+	region_mutex.lock();
+
+	Chunk *block = region->chunks.load(std::memory_order_acquire);
+	if (block != nullptr) {
+		// Another thread was first.
+		region_mutex.unlock();
+		return block;
+	}
+
+	block = reinterpret_cast<Chunk *>(region_pool.alloc());
+	for (u32 slot = 0; slot < REGION_NUM_CHUNKS; slot++) {
+		if (region->is_occupied(slot)) {
+			Chunk *chunk = memnew_placement(block + slot, Chunk);
+			chunk->chunk_coord = region->slot_chunk_coord(slot);
+			Region::decode_chunk(region->compressed.data() + region->compressed_offsets[slot], chunk);
+		}
+	}
+	region->compressed = std::vector<u8>();
+	region->compressed_offsets = std::vector<u32>();
+
+	region->chunks.store(block, std::memory_order_release);
+
+	if (is_step_running()) {
+		// Readers may inflate while stepping. Chunks are only read until linked.
+		unlinked_regions.push_back(region);
+	} else {
+		link_region(region);
+	}
+
+	region_mutex.unlock();
+	return block;
+}
+
+void Grid::link_region(Region *region) {
+	Chunk *block = region->chunks.load(std::memory_order_relaxed);
+	for (u32 slot = 0; slot < REGION_NUM_CHUNKS; slot++) {
+		if (region->is_occupied(slot)) {
+			Chunk *chunk = block + slot;
+			chunk->link_neighbors();
+			if (chunk->is_active()) {
+				chunk->add_to_active_set();
+			}
+		}
+	}
+}
+
+void Grid::compress_region(Region *region) {
+	Chunk *block = region->chunks.load(std::memory_order_relaxed);
+	TEST_ASSERT(block != nullptr, "region is already compressed");
+
+	region->compressed_offsets.resize(REGION_NUM_CHUNKS, 0);
+	region->compressed_cells_version = Chunk::new_cells_version();
+	for (u32 slot = 0; slot < REGION_NUM_CHUNKS; slot++) {
+		Chunk *chunk = region->get_chunk(slot);
+		if (chunk != nullptr) {
+			region->compressed_offsets[slot] = u32(region->compressed.size());
+			Region::encode_chunk(chunk, region->compressed);
+		}
+	}
+	region->compressed.shrink_to_fit();
+
+	// Neighbors in other regions may not point to these chunks anymore.
+	for (u32 slot = 0; slot < REGION_NUM_CHUNKS; slot++) {
+		Chunk *chunk = region->get_chunk(slot);
+		if (chunk != nullptr) {
+			chunk->unlink_neighbors();
+		}
+	}
+	for (u32 slot = 0; slot < REGION_NUM_CHUNKS; slot++) {
+		Chunk *chunk = region->get_chunk(slot);
+		if (chunk != nullptr) {
+			chunk->~Chunk();
+		}
+	}
+
+	region->chunks.store(nullptr, std::memory_order_release);
+	region_pool.free(block);
+}
+
+void Grid::delete_region(Region *region) {
+	Chunk *block = region->chunks.load(std::memory_order_relaxed);
+	if (block != nullptr) {
+		for (u32 slot = 0; slot < REGION_NUM_CHUNKS; slot++) {
+			Chunk *chunk = region->get_chunk(slot);
+			if (chunk != nullptr) {
+				chunk->unlink_neighbors();
+				region->destroy_chunk(slot);
+			}
+		}
+		region_pool.free(block);
+	}
+
+	regions.erase(chunk_id(region->region_coord));
+	memdelete(region);
+}
+
+void Grid::read_chunk_layers(
+		Vector2i chunk_coord,
+		u32 *cells_scratch,
+		const u32 *&cells,
+		u32 &uniform_cell,
+		u32 *background_scratch,
+		const u32 *&background,
+		u32 &uniform_background) {
+	cells = nullptr;
+	uniform_cell = 0;
+	background = nullptr;
+	uniform_background = 0;
+
+	Region *region = regions.get(chunk_id(Region::to_region_coord(chunk_coord)));
+	if (region == nullptr) {
+		return;
+	}
+
+	u32 slot = Region::to_slot(chunk_coord);
+	if (!region->is_occupied(slot)) {
+		return;
+	}
+
+	Chunk *block = region->chunks.load(std::memory_order_acquire);
+	if (block == nullptr) {
+		region_mutex.lock();
+		block = region->chunks.load(std::memory_order_acquire);
+		if (block == nullptr) {
+			if (cells_scratch != nullptr) {
+				cells = region->decode_compressed_cells(slot, false, cells_scratch, uniform_cell);
+			}
+			if (background_scratch != nullptr) {
+				background = region->decode_compressed_cells(slot, true, background_scratch, uniform_background);
+			}
+			region_mutex.unlock();
+			return;
+		}
+		region_mutex.unlock();
+	}
+
+	// Cells may be written while reading them, but their blocks are only retired.
+	// Acquire pairs with the release stores of materialize and fill.
+	Chunk &chunk = block[slot];
+	if (cells_scratch != nullptr) {
+		cells = chunk.cells.load(std::memory_order_acquire);
+		uniform_cell = chunk.uniform_cell.load(std::memory_order_relaxed);
+	}
+	// Most chunks have no background, which is left as a uniform 0.
+	if (background_scratch != nullptr && chunk.background.decode_shared(background_scratch)) {
+		background = background_scratch;
+	}
 }
 
 void Grid::clear_cell_materials() {
 	cell_materials.clear();
+	std::fill_n(step_materials, 4096, StepMaterial());
+	reaction_table_dirty = true;
 }
 
 void Grid::add_cell_material(Object *obj) {
-	cell_materials.push_back(CellMaterial(obj));
+	push_cell_material(CellMaterial(obj));
+}
+
+void Grid::push_cell_material(const CellMaterial &mat) {
+	ERR_FAIL_COND_MSG(cell_materials.size() >= 4096, "can not have more than 4096 cell materials");
+
+	cell_materials.push_back(mat);
+	StepMaterial step_material = StepMaterial(mat);
+	// Reactions are not known yet. Set again by build_reaction_table.
+	step_material.set_kind(false);
+	if (cell_materials.size() == 1) {
+		// Default for unknown materials.
+		std::fill_n(step_materials, 4096, step_material);
+	} else {
+		step_materials[cell_materials.size() - 1] = step_material;
+	}
+	reaction_table_dirty = true;
 }
 
 void Grid::clear_cell_reactions() {
 	cell_reactions.clear();
+	reaction_table_dirty = true;
 }
 
-u64 Grid::add_cell_reaction(u32 in1, u32 in2, u32 out1, u32 out2, f64 probability, Callable callback) {
+u64 Grid::add_cell_reaction(u32 in1, u32 in2, u32 out1, u32 out2, f64 probability, Callable callback, bool batch_callback) {
 	ERR_FAIL_COND_V_MSG(
 			in1 >= cell_materials.size(),
 			0,
@@ -313,6 +702,7 @@ u64 Grid::add_cell_reaction(u32 in1, u32 in2, u32 out1, u32 out2, f64 probabilit
 			"unknow cell material idx for out2");
 
 	last_modified_tick = tick;
+	reaction_table_dirty = true;
 
 	bool swap = false;
 	u32 reaction_key = reations_key(in1, in2, swap);
@@ -334,6 +724,7 @@ u64 Grid::add_cell_reaction(u32 in1, u32 in2, u32 out1, u32 out2, f64 probabilit
 	}
 
 	reaction.callback = callback;
+	reaction.batch_callback = batch_callback;
 
 	reaction.reaction_id = 0;
 
@@ -352,6 +743,7 @@ u64 Grid::add_cell_reaction(u32 in1, u32 in2, u32 out1, u32 out2, f64 probabilit
 
 bool Grid::remove_cell_reaction(u64 reaction_id) {
 	last_modified_tick = tick;
+	reaction_table_dirty = true;
 
 	u32 key = u32(reaction_id & 0xFFFFFFFF);
 	u32 id = u32(reaction_id >> 32);
@@ -398,15 +790,31 @@ void Grid::print_internals() {
 			print_line("	out2:", reaction.mat_idx_out2);
 			print_line("	callback:", !reaction.callback.is_null());
 			print_line("	callback valid:", reaction.callback.is_valid());
+			print_line("	batch callback:", reaction.batch_callback);
 		}
 	}
 }
 
 void Grid::clear() {
-	for (auto &[chunk_id, chunk] : chunks) {
-		delete chunk;
+	// Chunks only own pool memory, so no need to destruct them one by one.
+	for (Region *region : regions) {
+		memdelete(region);
 	}
-	chunks = {};
+	regions.clear();
+	region_pool.release_all();
+	Chunk::buffer_pool.release_all();
+	Background::release_all();
+
+	unlinked_regions.clear();
+	active_chunks.clear();
+	deferred_chunks.clear();
+	last_active_rects.clear();
+	last_full_step_tick = -1;
+	last_modified_tick = 0;
+
+	num_skipped_ticks = 0;
+	num_late_ticks = 0;
+	skipped_since_last_step = false;
 
 	tick = 0;
 	seed = 0;
@@ -440,54 +848,222 @@ Rect2i Grid::get_chunk_active_rect(Vector2i chunk_coord) {
 }
 
 i64 Grid::get_grid_memory_usage() {
-	i64 mem = 0;
-	for (auto &pair : chunks) {
-		mem += pair.second->get_memory_usage();
+	i64 mem = regions.get_memory_usage() +
+			region_pool.get_reserved_bytes() +
+			Chunk::buffer_pool.get_reserved_bytes() +
+			Background::get_reserved_bytes();
+	for (Region *region : regions) {
+		mem += sizeof(Region) + region->get_compressed_memory_usage();
 	}
 	return mem;
 }
 
-Ref<Image> Grid::get_cell_buffer(Rect2i rect, bool background, bool clean) {
-	// Tried not creating a new buffer each time, but it was not noticeably faster.
-	auto image_data = Vector<u8>();
-	image_data.resize(rect.size.x * 4 * rect.size.y);
-	u32 *image_buffer = reinterpret_cast<u32 *>(image_data.ptrw());
-
-	// This is where 99% of the time is spent.
-	IterChunk chunk_iter = IterChunk(rect);
-	while (chunk_iter.next()) {
-		Chunk *chunk = get_chunk(chunk_iter.chunk_coord);
-		u32 *cells;
-		if (chunk == nullptr) {
-			cells = nullptr;
-		} else if (background) {
-			cells = chunk->background;
-		} else {
-			cells = &chunk->cells[0];
+Dictionary Grid::get_grid_memory_stats() {
+	Dictionary stats = Dictionary();
+	u64 num_chunk = 0;
+	u64 num_compressed_region = 0;
+	i64 compressed_bytes = 0;
+	for (Region *region : regions) {
+		num_chunk += region->num_chunks;
+		if (!region->is_resident()) {
+			num_compressed_region += 1;
+			compressed_bytes += region->get_compressed_memory_usage();
 		}
+	}
+	stats["num_chunk"] = num_chunk;
+	stats["num_region"] = regions.size();
+	stats["num_compressed_region"] = num_compressed_region;
+	stats["compressed_bytes"] = compressed_bytes;
+	stats["region_table"] = regions.get_memory_usage();
+	stats["region_reserved"] = region_pool.get_reserved_bytes();
+	stats["num_buffer"] = Chunk::buffer_pool.get_num_used();
+	stats["buffer_used"] = Chunk::buffer_pool.get_used_bytes();
+	stats["buffer_reserved"] = Chunk::buffer_pool.get_reserved_bytes();
+	stats["num_background"] = Background::get_num_used();
+	stats["background_used"] = Background::get_used_bytes();
+	stats["background_reserved"] = Background::get_reserved_bytes();
+	return stats;
+}
+
+u64 Grid::get_chunk_cells_version(Vector2i chunk_coord) {
+	Region *region = regions.get(chunk_id(Region::to_region_coord(chunk_coord)));
+	if (region == nullptr) {
+		return 0;
+	}
+
+	u32 slot = Region::to_slot(chunk_coord);
+	if (!region->is_occupied(slot)) {
+		return 0;
+	}
 
-		Vector2i image_offset = chunk_iter.chunk_coord * 32 - rect.position;
-		Iter2D local_iter = chunk_iter.local_iter();
-		if (cells == nullptr) {
-			while (local_iter.next()) {
-				u32 *img_ptr = image_buffer + image_offset.x + local_iter.coord.x + (image_offset.y + local_iter.coord.y) * rect.size.x;
-				*img_ptr = 0;
+	Chunk *block = region->chunks.load(std::memory_order_acquire);
+	if (block == nullptr) {
+		return region->compressed_cells_version;
+	}
+	return block[slot].cells_version.load(std::memory_order_acquire);
+}
+
+// Copy one layer of a chunk read by Grid::read_chunk_layers.
+static void copy_layer_cells(
+		const u32 *cells,
+		u32 uniform_cell,
+		bool background,
+		bool clean,
+		Vector2i local_start,
+		Vector2i local_end,
+		u32 *buffer,
+		Vector2i buffer_offset,
+		i32 buffer_stride) {
+	i32 width = local_end.x - local_start.x;
+	if (cells == nullptr) {
+		// Missing or uniform chunk.
+		if (clean) {
+			if (background) {
+				Cell::clean_background(uniform_cell);
+			} else {
+				Cell::clean(uniform_cell);
 			}
+		}
+
+		for (i32 y = local_start.y; y < local_end.y; y++) {
+			u32 *buffer_ptr = buffer + buffer_offset.x + local_start.x + (buffer_offset.y + y) * buffer_stride;
+			std::fill_n(buffer_ptr, width, uniform_cell);
+		}
+	} else if (!clean) {
+		u64 row_bytes = u64(width) * sizeof(u32);
+		for (i32 y = local_start.y; y < local_end.y; y++) {
+			u32 *buffer_ptr = buffer + buffer_offset.x + local_start.x + (buffer_offset.y + y) * buffer_stride;
+			std::memcpy(buffer_ptr, cells + local_start.x + y * 32, row_bytes);
+		}
+	} else {
+		// Same mask for every cell, so compilers can vectorize it.
+		u32 mask = MAX_U32;
+		if (background) {
+			Cell::clean_background(mask);
 		} else {
-			while (local_iter.next()) {
-				u32 *img_ptr = image_buffer + image_offset.x + local_iter.coord.x + (image_offset.y + local_iter.coord.y) * rect.size.x;
-				u32 cell = cells[local_iter.coord.x + local_iter.coord.y * 32];
-				if (clean) {
-					if (background) {
-						Cell::clean_background(cell);
-					} else {
-						Cell::clean(cell);
-					}
-				}
-				*img_ptr = cell;
+			Cell::clean(mask);
+		}
+
+		for (i32 y = local_start.y; y < local_end.y; y++) {
+			u32 *buffer_ptr = buffer + buffer_offset.x + local_start.x + (buffer_offset.y + y) * buffer_stride;
+			const u32 *row = cells + local_start.x + y * 32;
+			for (i32 x = 0; x < width; x++) {
+				buffer_ptr[x] = row[x] & mask;
 			}
 		}
 	}
+}
+
+void Grid::copy_chunk_cells(
+		Vector2i chunk_coord,
+		Rect2i rect,
+		bool background,
+		bool clean,
+		u32 *buffer,
+		Rect2i buffer_rect) {
+	if (background) {
+		copy_chunk_layers(chunk_coord, rect, clean, nullptr, buffer, buffer_rect);
+	} else {
+		copy_chunk_layers(chunk_coord, rect, clean, buffer, nullptr, buffer_rect);
+	}
+}
+
+void Grid::copy_chunk_layers(
+		Vector2i chunk_coord,
+		Rect2i rect,
+		bool clean,
+		u32 *buffer,
+		u32 *background_buffer,
+		Rect2i buffer_rect) {
+	Rect2i copy_rect = Rect2i(chunk_coord * 32, Vector2i(32, 32)).intersection(rect);
+	if (!copy_rect.has_area()) {
+		return;
+	}
+
+	// Compressed chunks and backgrounds are decoded here.
+	u32 cells_scratch[32 * 32];
+	u32 background_scratch[32 * 32];
+	const u32 *cells;
+	const u32 *background;
+	u32 uniform_cell;
+	u32 uniform_background;
+	read_chunk_layers(
+			chunk_coord,
+			buffer != nullptr ? cells_scratch : nullptr,
+			cells,
+			uniform_cell,
+			background_buffer != nullptr ? background_scratch : nullptr,
+			background,
+			uniform_background);
+
+	Vector2i local_start = copy_rect.position - chunk_coord * 32;
+	Vector2i local_end = copy_rect.get_end() - chunk_coord * 32;
+	Vector2i buffer_offset = chunk_coord * 32 - buffer_rect.position;
+	if (buffer != nullptr) {
+		copy_layer_cells(cells, uniform_cell, false, clean, local_start, local_end, buffer, buffer_offset, buffer_rect.size.x);
+	}
+	if (background_buffer != nullptr) {
+		copy_layer_cells(background, uniform_background, true, clean, local_start, local_end, background_buffer, buffer_offset, buffer_rect.size.x);
+	}
+}
+
+void Grid::copy_cell_buffer_band(void *bands_ptr, u32 band_idx) {
+	CellBufferBands &bands = *reinterpret_cast<CellBufferBands *>(bands_ptr);
+	i32 y = bands.chunk_start.y + i32(band_idx);
+	for (i32 x = bands.chunk_start.x; x < bands.chunk_end_x; x++) {
+		copy_chunk_layers(Vector2i(x, y), bands.rect, bands.clean, bands.buffer, bands.background_buffer, bands.rect);
+	}
+}
+
+void Grid::copy_cell_buffers(Rect2i rect, bool clean, u32 *buffer, u32 *background_buffer, i32 num_threads) {
+	if (!rect.has_area()) {
+		return;
+	}
+
+	Vector2i chunk_start = div_floor(rect.position, 32);
+	Vector2i chunk_end = div_floor(rect.get_end() - Vector2i(1, 1), 32) + Vector2i(1, 1);
+	CellBufferBands bands = { rect, clean, buffer, background_buffer, chunk_start, chunk_end.x };
+	i32 num_bands = chunk_end.y - chunk_start.y;
+
+	WorkerThreadPool *pool = WorkerThreadPool::get_singleton();
+	if (num_threads <= 0) {
+		num_threads = pool->get_thread_count();
+	}
+	num_threads = MIN(num_threads, num_bands);
+
+	lock_cell_reads();
+	if (num_threads <= 1) {
+		// Not worth waking workers for a single band.
+		for (i32 i = 0; i < num_bands; i++) {
+			copy_cell_buffer_band(&bands, u32(i));
+		}
+	} else {
+		// Bands write disjoint rows of buffers and only read the grid.
+		WorkerThreadPool::GroupID group_id = pool->add_native_group_task(
+				&Grid::copy_cell_buffer_band,
+				&bands,
+				num_bands,
+				num_threads,
+				true,
+				"Grid copy cell buffer");
+		pool->wait_for_group_task_completion(group_id);
+	}
+	unlock_cell_reads();
+}
+
+Ref<Image> Grid::get_cell_buffer(Rect2i rect, bool background, bool clean, i32 num_threads) {
+	// Tried not creating a new buffer each time, but it was not noticeably faster.
+	// See CellBuffer to only copy chunks which changed.
+	auto image_data = Vector<u8>();
+	image_data.resize(rect.size.x * 4 * rect.size.y);
+	u32 *image_buffer = reinterpret_cast<u32 *>(image_data.ptrw());
+
+	// This is where 99% of the time is spent.
+	if (background) {
+		copy_cell_buffers(rect, clean, nullptr, image_buffer, num_threads);
+	} else {
+		copy_cell_buffers(rect, clean, image_buffer, nullptr, num_threads);
+	}
 
 	return Image::create_from_data(
 			rect.size.x,
@@ -497,6 +1073,32 @@ Ref<Image> Grid::get_cell_buffer(Rect2i rect, bool background, bool clean) {
 			image_data);
 }
 
+Array Grid::get_cell_buffers(Rect2i rect, bool clean, i32 num_threads) {
+	auto image_data = Vector<u8>();
+	image_data.resize(rect.size.x * 4 * rect.size.y);
+	auto background_data = Vector<u8>();
+	background_data.resize(rect.size.x * 4 * rect.size.y);
+	u32 *image_buffer = reinterpret_cast<u32 *>(image_data.ptrw());
+	u32 *background_buffer = reinterpret_cast<u32 *>(background_data.ptrw());
+
+	copy_cell_buffers(rect, clean, image_buffer, background_buffer, num_threads);
+
+	Array images = Array();
+	images.push_back(Image::create_from_data(
+			rect.size.x,
+			rect.size.y,
+			false,
+			Image::FORMAT_RF,
+			image_data));
+	images.push_back(Image::create_from_data(
+			rect.size.x,
+			rect.size.y,
+			false,
+			Image::FORMAT_RF,
+			background_data));
+	return images;
+}
+
 PackedByteArray Grid::get_chunk_state(Vector2i chunk_coord) {
 	return PackedByteArray(); // todo
 }
@@ -546,6 +1148,7 @@ void Grid::set_cell_material_idx(ChunkLocalCoord coord, u32 material_idx) {
 		while (cell_iter.next()) {
 			Cell::set_active(*chunk->get_cell_ptr(cell_iter.coord), true);
 		}
+		chunk->cells_changed();
 	}
 }
 
@@ -559,6 +1162,7 @@ void Grid::set_cell_color(ChunkLocalCoord coord, u32 color) {
 
 	if (get_cell_material(Cell::material_idx(*cell)).can_color) {
 		Cell::set_color(*cell, color);
+		chunk->cells_changed();
 	}
 }
 
@@ -626,68 +1230,772 @@ TypedArray<Vector2i> Grid::get_line(Vector2i start, Vector2i end) {
 }
 
 bool Grid::chunk_exists(Vector2i chunk_coord) {
-	return get_chunk(chunk_coord) != nullptr;
+	// Does not inflate.
+	Region *region = regions.get(chunk_id(Region::to_region_coord(chunk_coord)));
+	return region != nullptr && region->is_occupied(Region::to_slot(chunk_coord));
 }
 
 bool Grid::try_create_chunk(Vector2i chunk_coord) {
-	auto added = chunks.emplace(chunk_id(chunk_coord), nullptr);
-	if (added.second) {
-		added.first->second = new Chunk();
-		added.first->second->chunk_coord = chunk_coord;
-		return true;
+	Vector2i region_coord = Region::to_region_coord(chunk_coord);
+	u64 region_id = chunk_id(region_coord);
+	Region *region = regions.get(region_id);
+	if (region == nullptr) {
+		region = memnew(Region);
+		region->region_coord = region_coord;
+		region->chunks.store(reinterpret_cast<Chunk *>(region_pool.alloc()), std::memory_order_release);
+		*regions.try_insert(region_id) = region;
+	} else if (!region->is_resident()) {
+		// Existing chunks need to be linked for stepping.
+		inflate_region(region);
+	}
+
+	u32 slot = Region::to_slot(chunk_coord);
+	if (region->is_occupied(slot)) {
+		return false;
+	}
+
+	Chunk *chunk = region->create_chunk(slot);
+	chunk->chunk_coord = chunk_coord;
+	chunk->link_neighbors();
+	// New chunks start active.
+	chunk->add_to_active_set();
+	return true;
+}
+
+void Grid::set_unload_chunk_callback(Callable callback) {
+	unload_chunk_callback = callback;
+}
+
+void Grid::set_memory_budget(i64 bytes) {
+	ERR_FAIL_COND_MSG(bytes < 0, "memory budget can not be negative");
+	max_num_region = bytes / i64(REGION_MAX_SIZE);
+	if (bytes > 0 && max_num_region == 0) {
+		max_num_region = 1;
 	}
-	return false;
+}
+
+i64 Grid::get_memory_budget() {
+	return max_num_region * i64(REGION_MAX_SIZE);
+}
+
+i64 Grid::unload_old_chunks(TypedArray<Rect2i> keep_rects) {
+	if (max_num_region <= 0 || i64(regions.size()) <= max_num_region) {
+		return 0;
+	}
+
+	std::vector<Rect2i> region_rects = keep_region_rects(keep_rects);
+
+	// (last_step_tick, region_id)
+	std::vector<std::pair<i64, u64>> candidates = {};
+	for (Region *region : regions) {
+		if (!is_region_kept(region_rects, region)) {
+			candidates.push_back({ region->last_step_tick, chunk_id(region->region_coord) });
+		}
+	}
+
+	// Table iteration order depends on insertion history, so sort on the id too.
+	std::sort(candidates.begin(), candidates.end());
+
+	// Unload a bit more than needed so this does not run every step.
+	i64 target = max_num_region - max_num_region / 8;
+	i64 num_unloaded = 0;
+	for (auto &[last_step_tick, region_id] : candidates) {
+		if (i64(regions.size()) <= target) {
+			break;
+		}
+
+		Region *region = regions.get(region_id);
+		for (u32 slot = 0; slot < REGION_NUM_CHUNKS; slot++) {
+			if (!region->is_occupied(slot)) {
+				continue;
+			}
+
+			// Reading the chunk from the callback inflates it as needed.
+			if (unload_chunk_callback.is_valid()) {
+				unload_chunk_callback.call(region->slot_chunk_coord(slot));
+			}
+			num_unloaded += 1;
+		}
+
+		delete_region(region);
+	}
+
+	if (num_unloaded > 0) {
+		prune_active_chunks();
+		release_free_pages();
+	}
+
+	return num_unloaded;
+}
+
+void Grid::set_compress_after_ticks(i64 value) {
+	compress_after_ticks = value;
+}
+
+i64 Grid::get_compress_after_ticks() {
+	return compress_after_ticks;
+}
+
+i64 Grid::compress_old_chunks(TypedArray<Rect2i> keep_rects) {
+	if (compress_after_ticks <= 0) {
+		return 0;
+	}
+
+	std::vector<Rect2i> region_rects = keep_region_rects(keep_rects);
+	i64 threshold = tick - compress_after_ticks;
+
+	i64 num_compressed = 0;
+	for (Region *region : regions) {
+		if (!region->is_resident() ||
+				is_region_kept(region_rects, region) ||
+				region->last_step_tick >= threshold) {
+			continue;
+		}
+
+		// cells_save is not compressed.
+		bool has_save = false;
+		for (u32 slot = 0; slot < REGION_NUM_CHUNKS; slot++) {
+			Chunk *chunk = region->get_chunk(slot);
+			if (chunk != nullptr && chunk->cells_save != nullptr) {
+				has_save = true;
+				break;
+			}
+		}
+		if (has_save) {
+			continue;
+		}
+
+		compress_region(region);
+		num_compressed += 1;
+	}
+
+	if (num_compressed > 0) {
+		prune_active_chunks();
+		release_free_pages();
+	}
+
+	return num_compressed;
+}
+
+void Grid::release_free_pages() {
+	// Cells and backgrounds of destroyed chunks were retired.
+	reclaim_retired_blocks();
+	Chunk::buffer_pool.trim();
+	Background::trim_all();
 }
 
 void Grid::step_chunk(Vector2i chunk_coord) {
-	Chunk::step_chunk(chunk_coord);
+	Chunk *chunk = get_chunk(chunk_coord);
+	ERR_FAIL_NULL_MSG(chunk, "step_chunk needs it and its neighbors to exist");
+	build_reaction_table();
+	get_region(chunk_coord)->last_step_tick = tick;
+
+	if (reaction_arenas.empty()) {
+		reaction_arenas.resize(1);
+	}
+	step_chunk_into(chunk, reaction_arenas[0], next_step_order);
+	next_step_order += 1;
+}
+
+void Grid::step_chunk_into(Chunk *chunk, ReactionArena &arena, u32 order) {
+	u32 start = u32(arena.callbacks.size());
+	Chunk::step_chunk(chunk, arena.callbacks);
+	u32 end = u32(arena.callbacks.size());
+
+	if (start != end) {
+		// Stable so callbacks at the same coord keep the order they were triggered in.
+		std::stable_sort(arena.callbacks.begin() + start, arena.callbacks.end(), [](auto &a, auto &b) {
+			return a.second < b.second;
+		});
+		arena.runs.push_back({ order, start, end });
+	}
+}
+
+void Grid::step_and_generate(Chunk *chunk, ReactionArena &arena, u32 order) {
+	for (i32 i = 0; i < 9; i++) {
+		Chunk *other = chunk->neighbors[i];
+		if (other != nullptr && other->needs_generation) {
+			other->needs_generation = false;
+			if (generate_chunk_callback.is_valid()) {
+				generate_chunk_callback.call(other->chunk_coord);
+			}
+		}
+	}
+
+	step_chunk_into(chunk, arena, order);
+}
+
+void Grid::step_column(void *columns, u32 column_idx) {
+	StepColumn &column = (*reinterpret_cast<std::vector<StepColumn> *>(columns))[column_idx];
+	ReactionArena &arena = reaction_arenas[column_idx];
+	// Other columns in this pass are at least 3 chunks away,
+	// so only this task can touch these chunks and their neighbors.
+	for (u32 i = 0; i < column.chunks.size(); i++) {
+		step_and_generate(column.chunks[i], arena, column.first_order + i);
+	}
+}
+
+void Grid::step_graph_task(void *graph_ptr) {
+	StepGraph &graph = *reinterpret_cast<StepGraph *>(graph_ptr);
+	WorkerThreadPool *pool = WorkerThreadPool::get_singleton();
+
+	graph.mutex.lock();
+	u32 arena_idx = graph.free_arenas.back();
+	graph.free_arenas.pop_back();
+
+	while (!graph.ready.empty()) {
+		u32 idx = graph.ready.back();
+		graph.ready.pop_back();
+
+		graph.mutex.unlock();
+		step_and_generate(graph.chunks[idx], reaction_arenas[arena_idx], graph.first_order + idx);
+		graph.mutex.lock();
+
+		for (u32 i = graph.dependents_start[idx]; i < graph.dependents_start[idx + 1]; i++) {
+			u32 dependent = graph.dependents[i];
+			graph.num_dependencies[dependent] -= 1;
+			if (graph.num_dependencies[dependent] == 0) {
+				graph.ready.push_back(dependent);
+			}
+		}
+		graph.num_remaining -= 1;
+
+		// This task takes the next ready chunk. New tasks take the others.
+		u32 num_new = MIN(graph.max_tasks - graph.num_running, u32(graph.ready.size()));
+		num_new = num_new > 0 ? num_new - 1 : 0;
+		for (u32 i = 0; i < num_new; i++) {
+			graph.num_running += 1;
+			graph.tasks.push_back(pool->add_native_task(&Grid::step_graph_task, &graph, true, "Grid step chunks"));
+		}
+	}
+
+	graph.free_arenas.push_back(arena_idx);
+	graph.num_running -= 1;
+	graph.mutex.unlock();
+}
+
+void Grid::set_generate_chunk_callback(Callable callback) {
+	generate_chunk_callback = callback;
+}
+
+void Grid::prepare_step_rects(TypedArray<Rect2i> rects) {
+	for (i32 i = 0; i < rects.size(); i++) {
+		Rect2i rect = rects[i];
+		if (!rect.has_area()) {
+			continue;
+		}
+
+		// Chunks stepped need their neighbors.
+		for (i32 y = rect.position.y - 1; y < rect.get_end().y + 1; y++) {
+			for (i32 x = rect.position.x - 1; x < rect.get_end().x + 1; x++) {
+				Vector2i chunk_coord = Vector2i(x, y);
+				if (try_create_chunk(chunk_coord)) {
+					get_chunk_resident(chunk_coord)->needs_generation = true;
+				}
+			}
+		}
+	}
+}
+
+void Grid::step_rects(TypedArray<Rect2i> rects) {
+	std::vector<Vector2i> chunk_coords = {};
+	for (i32 i = 0; i < rects.size(); i++) {
+		Rect2i rect = rects[i];
+		for (i32 y = rect.position.y; y < rect.get_end().y; y++) {
+			for (i32 x = rect.position.x; x < rect.get_end().x; x++) {
+				chunk_coords.push_back(Vector2i(x, y));
+			}
+		}
+	}
+
+	step_chunks(chunk_coords);
+}
+
+void Grid::defer_over_budget(
+		std::vector<Vector2i> &chunk_coords,
+		u64 max_chunks,
+		const std::vector<Rect2i> &priority_rects) {
+	std::sort(chunk_coords.begin(), chunk_coords.end());
+	chunk_coords.erase(std::unique(chunk_coords.begin(), chunk_coords.end()), chunk_coords.end());
+	if (chunk_coords.size() <= max_chunks) {
+		return;
+	}
+
+	struct StepPriority {
+		// 0 in priority_rects, 1 otherwise.
+		u32 priority_class;
+		i64 last_step_tick;
+		Vector2i chunk_coord;
+	};
+	std::vector<StepPriority> priorities = {};
+	priorities.reserve(chunk_coords.size());
+	for (Vector2i chunk_coord : chunk_coords) {
+		Chunk *chunk = get_chunk_resident(chunk_coord);
+		priorities.push_back({
+				rects_have_point(priority_rects, chunk_coord) ? 0u : 1u,
+				chunk != nullptr ? chunk->last_step_tick : -1,
+				chunk_coord,
+		});
+	}
+
+	// Ties broken by coord, so the order is total.
+	std::sort(priorities.begin(), priorities.end(), [](const StepPriority &a, const StepPriority &b) {
+		if (a.priority_class != b.priority_class) {
+			return a.priority_class < b.priority_class;
+		}
+		if (a.last_step_tick != b.last_step_tick) {
+			return a.last_step_tick < b.last_step_tick;
+		}
+		return a.chunk_coord < b.chunk_coord;
+	});
+
+	chunk_coords.clear();
+	for (u64 i = 0; i < priorities.size(); i++) {
+		if (i < max_chunks) {
+			chunk_coords.push_back(priorities[i].chunk_coord);
+		} else {
+			deferred_chunks.push_back(priorities[i].chunk_coord);
+		}
+	}
+}
+
+i64 Grid::get_num_deferred_chunks() {
+	return i64(deferred_chunks.size());
+}
+
+i64 Grid::get_num_active_chunks() {
+	return i64(active_chunks.size());
+}
+
+void Grid::step_active_rects(TypedArray<Rect2i> rects, i64 max_chunks, TypedArray<Rect2i> priority_rects) {
+	std::vector<Rect2i> requested_rects = {};
+	for (i32 i = 0; i < rects.size(); i++) {
+		Rect2i rect = rects[i];
+		if (rect.has_area()) {
+			requested_rects.push_back(rect);
+		}
+	}
+
+	// Chunks last stepped before a reaction changed need to be force stepped.
+	// Rare, as it only follows a change to reactions.
+	bool full_step = last_full_step_tick <= last_modified_tick;
+	if (full_step) {
+		last_full_step_tick = tick;
+	}
+
+	// Take chunks in rects out of active_chunks. They add themselves back when activated while stepping.
+	std::vector<Vector2i> chunk_coords = {};
+	std::vector<Vector2i> kept_chunks = {};
+	for (Vector2i chunk_coord : active_chunks) {
+		Chunk *chunk = get_chunk_resident(chunk_coord);
+		if (chunk == nullptr || !chunk->in_active_set) {
+			continue;
+		}
+
+		if (!rects_have_point(requested_rects, chunk_coord)) {
+			kept_chunks.push_back(chunk_coord);
+			continue;
+		}
+
+		chunk->in_active_set = false;
+		if (!full_step && chunk->is_active()) {
+			chunk_coords.push_back(chunk_coord);
+		}
+	}
+	active_chunks = std::move(kept_chunks);
+
+	// Every chunk, or only those entering rects, which may need to be generated or force stepped.
+	for (const Rect2i &rect : requested_rects) {
+		bool entering = full_step ||
+				std::find(last_active_rects.begin(), last_active_rects.end(), rect) == last_active_rects.end();
+		if (!entering) {
+			continue;
+		}
+
+		for (i32 y = rect.position.y; y < rect.get_end().y; y++) {
+			for (i32 x = rect.position.x; x < rect.get_end().x; x++) {
+				Vector2i chunk_coord = Vector2i(x, y);
+				if (full_step || !rects_have_point(last_active_rects, chunk_coord)) {
+					chunk_coords.push_back(chunk_coord);
+				}
+			}
+		}
+	}
+
+	// Chunks deferred by the budget are still owed a step while they stay in rects.
+	for (Vector2i chunk_coord : deferred_chunks) {
+		if (!full_step && rects_have_point(requested_rects, chunk_coord)) {
+			chunk_coords.push_back(chunk_coord);
+		}
+	}
+	deferred_chunks.clear();
+
+	if (max_chunks > 0) {
+		std::vector<Rect2i> requested_priority_rects = {};
+		for (i32 i = 0; i < priority_rects.size(); i++) {
+			requested_priority_rects.push_back(priority_rects[i]);
+		}
+		defer_over_budget(chunk_coords, u64(max_chunks), requested_priority_rects);
+	}
+
+	last_active_rects = std::move(requested_rects);
+
+	step_chunks(chunk_coords);
+}
+
+void Grid::step_chunks(std::vector<Vector2i> &chunk_coords) {
+	build_reaction_table();
+
+	// Pass (x mod 3), then column by column, then from bottom to top.
+	// Does not depend on rects order, so it is the same for all peers.
+	std::sort(chunk_coords.begin(), chunk_coords.end(), [](const Vector2i &a, const Vector2i &b) {
+		i32 a_pass = mod_neg(a.x, 3);
+		i32 b_pass = mod_neg(b.x, 3);
+		if (a_pass != b_pass) {
+			return a_pass < b_pass;
+		}
+		return a.x != b.x ? a.x < b.x : a.y > b.y;
+	});
+	chunk_coords.erase(std::unique(chunk_coords.begin(), chunk_coords.end()), chunk_coords.end());
+
+	std::vector<Chunk *> chunks = {};
+	chunks.reserve(chunk_coords.size());
+	// Chunks are sorted by column, so most are in the same region as the previous one.
+	Region *region = nullptr;
+	for (Vector2i chunk_coord : chunk_coords) {
+		Chunk *chunk = get_chunk_resident(chunk_coord);
+		ERR_CONTINUE_MSG(
+				chunk == nullptr || !chunk->has_all_neighbors(),
+				"step_rects needs prepare_step_rects to be called first");
+		chunks.push_back(chunk);
+
+		Vector2i region_coord = Region::to_region_coord(chunk_coord);
+		if (region == nullptr || region->region_coord != region_coord) {
+			region = regions.get(chunk_id(region_coord));
+		}
+		region->last_step_tick = tick;
+	}
+	if (chunks.empty()) {
+		return;
+	}
+
+	u32 first_order = next_step_order;
+	next_step_order += u32(chunks.size());
+
+	WorkerThreadPool *pool = WorkerThreadPool::get_singleton();
+	i32 num_threads = pool->get_thread_count();
+	if (max_step_threads > 0) {
+		num_threads = MIN(num_threads, max_step_threads);
+	}
+
+	if (step_by_column) {
+		std::vector<StepColumn> passes[3] = {};
+		for (u32 i = 0; i < chunks.size(); i++) {
+			Chunk *chunk = chunks[i];
+			std::vector<StepColumn> &pass = passes[mod_neg(chunk->chunk_coord.x, 3)];
+			if (pass.empty() || pass.back().x != chunk->chunk_coord.x) {
+				pass.push_back({ chunk->chunk_coord.x, first_order + i, {} });
+			}
+			pass.back().chunks.push_back(chunk);
+		}
+
+		// One arena per column.
+		for (std::vector<StepColumn> &pass : passes) {
+			if (reaction_arenas.size() < pass.size()) {
+				reaction_arenas.resize(pass.size());
+			}
+		}
+
+		// Columns of a pass are never neighbors.
+		for (std::vector<StepColumn> &pass : passes) {
+			if (pass.empty()) {
+				continue;
+			}
+
+			WorkerThreadPool::GroupID group_id = pool->add_native_group_task(
+					&Grid::step_column,
+					&pass,
+					i32(pass.size()),
+					MIN(num_threads, i32(pass.size())),
+					true,
+					"Grid step column");
+			pool->wait_for_group_task_completion(group_id);
+		}
+
+		return;
+	}
+
+	StepGraph graph = {};
+	u32 num_chunks = u32(chunks.size());
+	graph.chunks = std::move(chunks);
+	graph.first_order = first_order;
+
+	// Sorted by chunk id to find neighbors with a binary search.
+	std::vector<std::pair<u64, u32>> chunk_indices = {};
+	chunk_indices.reserve(num_chunks);
+	for (u32 i = 0; i < num_chunks; i++) {
+		chunk_indices.push_back({ chunk_id(graph.chunks[i]->chunk_coord), i });
+	}
+	std::sort(chunk_indices.begin(), chunk_indices.end());
+
+	// Count dependents, then fill them.
+	graph.num_dependencies.resize(num_chunks, 0);
+	graph.dependents_start.resize(num_chunks + 1, 0);
+	std::vector<u32> cursors = {};
+	for (i32 fill = 0; fill < 2; fill++) {
+		for (u32 i = 0; i < num_chunks; i++) {
+			Vector2i chunk_coord = graph.chunks[i]->chunk_coord;
+			// Neighborhoods overlap up to 2 chunks away.
+			for (i32 y = -2; y <= 2; y++) {
+				for (i32 x = -2; x <= 2; x++) {
+					u64 id = chunk_id(chunk_coord + Vector2i(x, y));
+					auto it = std::lower_bound(
+							chunk_indices.begin(),
+							chunk_indices.end(),
+							std::pair<u64, u32>(id, 0));
+					if (it == chunk_indices.end() || it->first != id || it->second >= i) {
+						continue;
+					}
+
+					u32 dependency = it->second;
+					if (fill == 0) {
+						graph.dependents_start[dependency + 1] += 1;
+						graph.num_dependencies[i] += 1;
+					} else {
+						graph.dependents[cursors[dependency]] = i;
+						cursors[dependency] += 1;
+					}
+				}
+			}
+		}
+
+		if (fill == 0) {
+			for (u32 i = 0; i < num_chunks; i++) {
+				graph.dependents_start[i + 1] += graph.dependents_start[i];
+			}
+			graph.dependents.resize(graph.dependents_start[num_chunks]);
+			cursors.assign(graph.dependents_start.begin(), graph.dependents_start.end() - 1);
+		}
+	}
+
+	// Reversed so that chunks early in step order are taken first.
+	for (u32 i = num_chunks; i > 0; i--) {
+		if (graph.num_dependencies[i - 1] == 0) {
+			graph.ready.push_back(i - 1);
+		}
+	}
+	graph.num_remaining = num_chunks;
+	graph.num_running = 0;
+
+	graph.max_tasks = u32(MIN(num_threads, i32(num_chunks)));
+	// One arena per running task.
+	if (reaction_arenas.size() < graph.max_tasks) {
+		reaction_arenas.resize(graph.max_tasks);
+	}
+	for (u32 i = 0; i < graph.max_tasks; i++) {
+		graph.free_arenas.push_back(i);
+	}
+
+	// Tasks start more tasks as chunks become ready, so tasks are added until the last one returns.
+	graph.mutex.lock();
+	u32 num_first = MIN(graph.max_tasks, u32(graph.ready.size()));
+	for (u32 i = 0; i < num_first; i++) {
+		graph.num_running += 1;
+		graph.tasks.push_back(pool->add_native_task(&Grid::step_graph_task, &graph, true, "Grid step chunks"));
+	}
+	u32 num_waited = 0;
+	while (num_waited < graph.tasks.size()) {
+		WorkerThreadPool::TaskID task_id = graph.tasks[num_waited];
+		graph.mutex.unlock();
+		pool->wait_for_task_completion(task_id);
+		num_waited += 1;
+		graph.mutex.lock();
+	}
+	graph.mutex.unlock();
+
+	ERR_FAIL_COND_MSG(graph.num_remaining != 0, "chunks left unstepped");
 }
 
 void Grid::pre_step() {}
 
+void Grid::run_step(void *userdata) {
+	step_callable.call();
+	step_running.store(false, std::memory_order_release);
+}
+
+void Grid::start_step(Callable step) {
+	ERR_FAIL_COND_MSG(is_step_running(), "previous step is still running");
+
+	if (step_thread.is_started()) {
+		step_thread.wait_to_finish();
+	}
+	if (skipped_since_last_step) {
+		skipped_since_last_step = false;
+		num_late_ticks += 1;
+	}
+
+	step_callable = step;
+	step_running.store(true, std::memory_order_relaxed);
+	Thread::Settings settings = Thread::Settings();
+	settings.priority = Thread::PRIORITY_HIGH;
+	step_thread.start(&Grid::run_step, nullptr, settings);
+}
+
+bool Grid::is_step_running() {
+	return step_running.load(std::memory_order_acquire);
+}
+
+bool Grid::try_finish_step(bool tick_waiting) {
+	if (is_step_running()) {
+		if (tick_waiting) {
+			num_skipped_ticks += 1;
+			skipped_since_last_step = true;
+		}
+		return false;
+	}
+
+	finish_step();
+	return true;
+}
+
+void Grid::finish_step() {
+	if (step_thread.is_started()) {
+		step_thread.wait_to_finish();
+	}
+	step_callable = Callable();
+
+	region_mutex.lock();
+	for (Region *region : unlinked_regions) {
+		link_region(region);
+	}
+	unlinked_regions.clear();
+	region_mutex.unlock();
+}
+
+Dictionary Grid::get_step_stats() {
+	Dictionary stats = Dictionary();
+	stats["running"] = is_step_running();
+	stats["skipped_ticks"] = num_skipped_ticks;
+	stats["late_ticks"] = num_late_ticks;
+	return stats;
+}
+
 void Grid::post_step() {
 	// Reactions callback.
-	std::vector<std::pair<Callable *, Vector2i>> vec = {};
-	u64 reserve_size = 0;
-	for (auto &[id, v] : thread_vectors) {
-		reserve_size += v.size();
-	}
-	// print_line(reserve_size);
-	vec.reserve(reserve_size);
-	for (auto &[id, v] : thread_vectors) {
-		vec.insert(vec.end(), v.begin(), v.end());
-	}
-	thread_vectors.clear();
-	std::sort(vec.begin(), vec.end(), [](auto &a, auto &b) {
-		return a.second < b.second;
-	});
-	for (auto &[callable, coord] : vec) {
-		callable->call(coord);
+	// Merge the sorted run of each chunk. Ties keep step order, so it is the same for all peers.
+	struct RunCursor {
+		const std::pair<CellReaction *, Vector2i> *next;
+		const std::pair<CellReaction *, Vector2i> *end;
+		u32 order;
+	};
+	std::vector<RunCursor> cursors = {};
+	u64 num_callbacks = 0;
+	for (ReactionArena &arena : reaction_arenas) {
+		for (ReactionArena::Run &run : arena.runs) {
+			cursors.push_back({ arena.callbacks.data() + run.start, arena.callbacks.data() + run.end, run.order });
+		}
+		num_callbacks += arena.callbacks.size();
 	}
 
-	if (tick % 1024 == 0) {
-		// i64 unload_threshold = tick - 120 - MAX(3600 - i64(chunks.size()), 0);
+	// Min heap on (coord, order).
+	auto greater = [](const RunCursor &a, const RunCursor &b) {
+		if (a.next->second != b.next->second) {
+			return b.next->second < a.next->second;
+		}
+		return a.order > b.order;
+	};
+	std::make_heap(cursors.begin(), cursors.end(), greater);
+
+	std::vector<std::pair<CellReaction *, Vector2i>> callbacks = {};
+	callbacks.reserve(num_callbacks);
+	while (!cursors.empty()) {
+		std::pop_heap(cursors.begin(), cursors.end(), greater);
+		RunCursor &cursor = cursors.back();
+		callbacks.push_back(*cursor.next);
+		cursor.next += 1;
+		if (cursor.next == cursor.end) {
+			cursors.pop_back();
+		} else {
+			std::push_heap(cursors.begin(), cursors.end(), greater);
+		}
+	}
 
-		for (auto it = chunks.begin(); it != chunks.end();) {
-			Chunk &chunk = *it->second;
+	for (ReactionArena &arena : reaction_arenas) {
+		arena.callbacks.clear();
+		arena.runs.clear();
+	}
+	next_step_order = 0;
+
+	// Reactions sharing an equal batched callback are grouped,
+	// so a reaction added for many materials is still called once.
+	std::vector<std::pair<Callable, PackedVector2iArray>> batches = {};
+	// Few reactions are batched, so a linear search is enough.
+	std::vector<std::pair<CellReaction *, u32>> batch_indices = {};
+
+	// Callbacks may step again, so arenas are cleared first.
+	for (auto &[reaction, coord] : callbacks) {
+		if (!reaction->batch_callback) {
+			reaction->callback.call(coord);
+			continue;
+		}
 
-			// Delete empty background.
-			if (chunk.num_background_cell == 0) {
-				delete[] chunk.background;
-				chunk.background = nullptr;
+		auto it = std::find_if(batch_indices.begin(), batch_indices.end(), [reaction](auto &entry) {
+			return entry.first == reaction;
+		});
+		if (it == batch_indices.end()) {
+			u32 batch_idx = 0;
+			while (batch_idx < batches.size() && batches[batch_idx].first != reaction->callback) {
+				batch_idx += 1;
+			}
+			if (batch_idx == batches.size()) {
+				batches.push_back({ reaction->callback, PackedVector2iArray() });
 			}
+			batch_indices.push_back({ reaction, batch_idx });
+			it = batch_indices.end() - 1;
+		}
+		batches[it->second].second.push_back(coord);
+	}
+
+	// In order of their first coord, after single callbacks.
+	for (auto &[callable, coords] : batches) {
+		callable.call(coords);
+	}
 
-			it++;
+	if (tick % 1024 == 0) {
+		for (Region *region : regions) {
+			for (u32 slot = 0; slot < REGION_NUM_CHUNKS; slot++) {
+				Chunk *chunk = region->get_chunk(slot);
+				if (chunk == nullptr) {
+					continue;
+				}
 
-			// if (chunk.last_step_tick < unload_threshold) {
-			// 	unload_chunk_callback.call(chunk.chunk_coord);
-			// 	delete it->second;
-			// 	it = chunks.erase(it);
-			// } else {
-			// 	++it;
-			// }
+				// Delete empty background.
+				if (chunk->num_background_cell == 0) {
+					chunk->free_background();
+				}
+			}
 		}
 	}
+
+	reclaim_retired_blocks();
+}
+
+void Grid::lock_cell_reads() {
+	cell_read_mutex.lock();
+}
+
+void Grid::unlock_cell_reads() {
+	cell_read_mutex.unlock();
+}
+
+void Grid::reclaim_retired_blocks() {
+	// A reader may still hold a retired block. Try again next step.
+	if (!cell_read_mutex.try_lock()) {
+		return;
+	}
+	Chunk::buffer_pool.reclaim();
+	Background::reclaim_all();
+	cell_read_mutex.unlock();
 }
 
 bool Grid::randb() {
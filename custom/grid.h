@@ -3,22 +3,44 @@
 
 #include "cell_material.hpp"
 #include "chunk.h"
+#include "chunk_table.hpp"
 #include "core/io/image.h"
 #include "core/math/color.h"
 #include "core/math/rect2i.h"
 #include "core/math/vector2i.h"
 #include "core/object/object.h"
+#include "core/os/mutex.h"
+#include "core/os/spin_lock.h"
+#include "core/os/thread.h"
 #include "core/variant/callable.h"
+#include "core/variant/dictionary.h"
 #include "core/variant/variant.h"
 #include "grid_iter.h"
+#include "pool.hpp"
 #include "preludes.h"
+#include "region.hpp"
 #include "rng.hpp"
+#include <atomic>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 
 const i32 GENERATION_SLICE_CHUNK_SIZE = 1024;
 
+// Reaction callbacks triggered while stepping, in runs of one chunk sorted by coord.
+// Each step task has its own, so adding to it is never locked.
+struct ReactionArena {
+	struct Run {
+		// Order its chunk was stepped in since the last post_step.
+		u32 order;
+		u32 start;
+		u32 end;
+	};
+
+	std::vector<std::pair<CellReaction *, Vector2i>> callbacks;
+	std::vector<Run> runs;
+};
+
 class Grid : public Object {
 	GDCLASS(Grid, Object);
 
@@ -29,15 +51,132 @@ private:
 	// Key is lower material_idx | higher material_idx << 16.
 	inline static std::unordered_map<u32, std::vector<CellReaction>> cell_reactions = {};
 
+	// cell_reactions compiled by build_reaction_table for stepping.
+	inline static std::vector<CellReaction> reaction_table = {};
+	// Range in reaction_table of reactions between lower m1 and higher m2 at m1 * num_reaction_materials + m2.
+	inline static std::vector<std::pair<u32, u32>> reaction_spans = {};
+	// Bit set for materials with any reaction.
+	inline static std::vector<u64> reactive_materials = {};
+	inline static u32 num_reaction_materials = 0;
+	// Materials or reactions changed since build_reaction_table.
+	inline static bool reaction_table_dirty = true;
+
 	inline static i64 tick = 0;
 	inline static u64 seed = 0;
 
-	inline static std::unordered_map<u64, Chunk *> chunks = {};
+	// Key is chunk_id of the region coord.
+	inline static ChunkTable<Region> regions = {};
+	// Storage for resident regions.
+	inline static BlockPool<REGION_BLOCK_SIZE, 1> region_pool = {};
+	// Held while inflating a region or reading a compressed region.
+	inline static Mutex region_mutex = Mutex();
+	// Held while reading cells which a step may write. See lock_cell_reads.
+	inline static Mutex cell_read_mutex = Mutex();
+	// Held while adding to active_chunks. Chunks are activated while stepping.
+	inline static SpinLock active_chunks_lock = SpinLock();
+
+	// Called with a chunk_coord just before that chunk is unloaded.
+	inline static Callable unload_chunk_callback = Callable();
+	// Called with a chunk_coord just before a neighbor of that new chunk is stepped.
+	inline static Callable generate_chunk_callback = Callable();
+	// Regions unloaded past this many. 0 means unlimited.
+	// Unlimited until unloaded chunks can be saved, as edits in them would be lost.
+	inline static i64 max_num_region = 0;
+	// Regions not stepped for this many ticks can be compressed. 0 means never.
+	inline static i64 compress_after_ticks = 3600;
+
+	// Coords of chunks added by Chunk::add_to_active_set.
+	// Stale when the chunk is not in_active_set anymore.
+	// Entries of deleted or compressed chunks are dropped right away by prune_active_chunks,
+	// so a chunk recreated at the same coord is never listed twice.
+	inline static std::vector<Vector2i> active_chunks = {};
+	// Rects of the last step_active_rects.
+	inline static std::vector<Rect2i> last_active_rects = {};
+	// Last tick step_active_rects stepped every chunk in its rects for a reaction change.
+	inline static i64 last_full_step_tick = -1;
+	// Chunks step_active_rects could not fit in its budget.
+	// Stepped before other chunks of their priority class when older.
+	inline static std::vector<Vector2i> deferred_chunks = {};
+
+	// Regions inflated while a step was running. Their chunks are linked by finish_step,
+	// as linking writes the neighbors of resident chunks which may be stepping.
+	inline static std::vector<Region *> unlinked_regions = {};
+
+	// Decode a compressed region and link its chunks. Thread safe.
+	static Chunk *inflate_region(Region *region);
+	// Link chunks of an inflated region with their resident neighbors and add the active ones to the active set.
+	// Needs to be called while not stepping.
+	static void link_region(Region *region);
+	// Region needs to be resident. Needs to be called while not stepping.
+	static void compress_region(Region *region);
+	// Destroy its chunks and remove it from regions.
+	static void delete_region(Region *region);
+	// Return fully free pages of the cell and background pools to the os.
+	static void release_free_pages();
+
+	// Cells and background of a chunk without inflating it, with a single region lookup.
+	// Safe while stepping with lock_cell_reads held. Cells may then mix old and new values.
+	// A layer is skipped when its scratch is nullptr.
+	// A layer's cells are nullptr with its uniform cell set if every cell is the same,
+	// or with its uniform cell set to 0 if chunk or its background does not exist.
+	static void read_chunk_layers(
+			Vector2i chunk_coord,
+			u32 *cells_scratch,
+			const u32 *&cells,
+			u32 &uniform_cell,
+			u32 *background_scratch,
+			const u32 *&background,
+			u32 &uniform_background);
+
+	// One per step task. Kept between steps to reuse their memory.
+	inline static std::vector<ReactionArena> reaction_arenas = {};
+	// Order of the next chunk stepped since the last post_step.
+	inline static u32 next_step_order = 0;
+
+	// Runs the step callable of start_step.
+	inline static Thread step_thread = {};
+	inline static Callable step_callable = Callable();
+	// Set until step_callable returns. step_thread still needs to be joined.
+	inline static std::atomic<bool> step_running = false;
+	// Calls to try_finish_step while a step was running and the next tick was waiting.
+	inline static i64 num_skipped_ticks = 0;
+	// Steps started after at least one skipped tick.
+	inline static i64 num_late_ticks = 0;
+	inline static bool skipped_since_last_step = false;
+
+	static void run_step(void *userdata);
+
+	// Step chunk and add its reaction callbacks to arena as a sorted run.
+	static void step_chunk_into(Chunk *chunk, ReactionArena &arena, u32 order);
+	// Generate new neighbors, then step chunk.
+	static void step_and_generate(Chunk *chunk, ReactionArena &arena, u32 order);
+	// Step a column of chunks from bottom to top. Run by WorkerThreadPool.
+	static void step_column(void *columns, u32 column_idx);
+	// Step ready chunks of a StepGraph until none is left, then return.
+	// Run by WorkerThreadPool. Never waits, so the pool stays free for other tasks.
+	static void step_graph_task(void *graph);
+
+	// Copy a row of chunks of a CellBufferBands. Run by WorkerThreadPool.
+	static void copy_cell_buffer_band(void *bands, u32 band_idx);
+	// Copy both layers of rect into buffers holding rect, one band per chunk row.
+	// Bands are split between up to num_threads tasks, or every pool thread if num_threads <= 0.
+	static void copy_cell_buffers(Rect2i rect, bool clean, u32 *buffer, u32 *background_buffer, i32 num_threads);
+	// Step chunks once in a deterministic order. Duplicates are stepped once.
+	static void step_chunks(std::vector<Vector2i> &chunk_coords);
+	// Keep the first max_chunks chunks and move the others to deferred_chunks.
+	// Chunks in priority_rects come first, then those not stepped for the longest.
+	// Only depends on synchronized state, so it is the same for all peers.
+	static void defer_over_budget(
+			std::vector<Vector2i> &chunk_coords,
+			u64 max_chunks,
+			const std::vector<Rect2i> &priority_rects);
 
 public:
 	inline static Rng temporal_rng = Rng(0);
 
 	inline static std::vector<CellMaterial> cell_materials = {};
+	// Indexed by any Cell::material_idx. Unknown materials are a copy of the default.
+	inline static StepMaterial step_materials[4096] = {};
 
 	// Any chunk last stepped before this will need to be force stepped.
 	inline static i64 last_modified_tick = 0;
@@ -45,30 +184,83 @@ public:
 	// Current bitmask for updated cells.
 	inline static u32 cell_updated_bitmask = 0;
 
-	static std::vector<std::pair<Callable *, Vector2i>> &get_reaction_callback_vector();
+	// Step every cell with the generic kernel instead of the one for its StepKind.
+	// Same result. For benchmarks.
+	inline static bool step_generic = false;
+
+	// Step each column as a single task in 3 passes (x mod 3),
+	// instead of each chunk as its own task. For benchmarks.
+	inline static bool step_by_column = false;
+
+	// Most pool threads used to step chunks. 0 means all of them. For benchmarks.
+	inline static i32 max_step_threads = 0;
+
+	// Thread safe. Use Chunk::add_to_active_set instead.
+	static void add_active_chunk(Vector2i chunk_coord);
+	// Drop stale and duplicate entries of active_chunks. Needs to be called while not stepping.
+	static void prune_active_chunks();
+
+	// Rebuild reaction_table if materials or reactions changed.
+	// Needs to be called while not stepping. Step methods call it.
+	static void build_reaction_table();
 
 	// Set pointers to nullptr if no reaction between m1 and m2.
-	static void reactions_between(
+	// Needs build_reaction_table to be called after reactions changed.
+	inline static void reactions_between(
 			CellReaction *&start,
 			CellReaction *&end,
 			u32 m1,
 			u32 m2,
-			bool &swap);
+			bool &swap) {
+		start = nullptr;
+		end = nullptr;
+
+		// Most pairs have no reaction.
+		if (m1 >= num_reaction_materials ||
+				m2 >= num_reaction_materials ||
+				(reactive_materials[m1 >> 6] & (1uLL << (m1 & 63))) == 0 ||
+				(reactive_materials[m2 >> 6] & (1uLL << (m2 & 63))) == 0) {
+			return;
+		}
+
+		swap = m1 > m2;
+		if (swap) {
+			std::swap(m1, m2);
+		}
+
+		std::pair<u32, u32> span = reaction_spans[m1 * num_reaction_materials + m2];
+		if (span.first != span.second) {
+			start = reaction_table.data() + span.first;
+			end = reaction_table.data() + span.second;
+		}
+	}
 
 	// Return default if not found.
 	static const CellMaterial &get_cell_material(u32 material_idx);
 
+	inline static const StepMaterial &get_step_material(u32 material_idx) {
+		TEST_ASSERT(material_idx < 4096, "material_idx must be less than 4096");
+		return step_materials[material_idx];
+	}
+
 	// Unaffected by time. Meant for world generation.
 	static Rng get_static_rng(Vector2i chunk_coord);
 	static Rng get_temporal_rng(Vector2i chunk_coord);
 
 	static u64 chunk_id(Vector2i chunk_coord);
 	// Return nullptr if not found.
+	// Inflate the chunk's region if it is compressed.
 	static Chunk *get_chunk(Vector2i chunk_coord);
+	// Return nullptr if not found or compressed.
+	static Chunk *get_chunk_resident(Vector2i chunk_coord);
+	// Region containing the chunk. Return nullptr if not found.
+	static Region *get_region(Vector2i chunk_coord);
 
 public: // godot api
 	static void clear_cell_materials();
 	static void add_cell_material(Object *obj);
+	// Same as add_cell_material for materials made in C++.
+	static void push_cell_material(const CellMaterial &mat);
 
 	static void clear_cell_reactions();
 	static u64 add_cell_reaction(
@@ -77,7 +269,8 @@ public: // godot api
 			u32 out1,
 			u32 out2,
 			f64 probability,
-			Callable callback);
+			Callable callback,
+			bool batch_callback = false);
 	static bool remove_cell_reaction(u64 reaction_id);
 	static void print_internals();
 
@@ -90,9 +283,42 @@ public: // godot api
 	static u64 get_seed();
 
 	static Rect2i get_chunk_active_rect(Vector2i chunk_coord);
+	// Bytes held by the region table and pools, including free blocks.
 	static i64 get_grid_memory_usage();
-
-	static Ref<Image> get_cell_buffer(Rect2i rect, bool background, bool clean);
+	static Dictionary get_grid_memory_stats();
+
+	// Changes when cells or background of a chunk change. 0 if it does not exist.
+	// Does not inflate the chunk's region.
+	static u64 get_chunk_cells_version(Vector2i chunk_coord);
+	// Hold while reading cells which a step may write.
+	// Blocks freed while stepping are retired, and only reused once nothing holds it.
+	static void lock_cell_reads();
+	static void unlock_cell_reads();
+	// Free retired cell and background blocks, unless another thread holds lock_cell_reads.
+	static void reclaim_retired_blocks();
+	// Copy cells of a chunk within rect into buffer, which holds the cells of buffer_rect.
+	// rect needs to be within buffer_rect. Does not inflate the chunk's region.
+	// Needs lock_cell_reads while a step may run.
+	static void copy_chunk_cells(
+			Vector2i chunk_coord,
+			Rect2i rect,
+			bool background,
+			bool clean,
+			u32 *buffer,
+			Rect2i buffer_rect);
+	// Same as copy_chunk_cells for both layers at once. A layer is skipped when its buffer is nullptr.
+	static void copy_chunk_layers(
+			Vector2i chunk_coord,
+			Rect2i rect,
+			bool clean,
+			u32 *buffer,
+			u32 *background_buffer,
+			Rect2i buffer_rect);
+	// Copied on up to num_threads WorkerThreadPool threads, or every pool thread if num_threads <= 0.
+	// Safe while stepping, see lock_cell_reads.
+	static Ref<Image> get_cell_buffer(Rect2i rect, bool background, bool clean, i32 num_threads = 1);
+	// Foreground and background images of rect, reading each chunk once.
+	static Array get_cell_buffers(Rect2i rect, bool clean, i32 num_threads = 1);
 
 	static PackedByteArray get_chunk_state(Vector2i chunk_coord);
 
@@ -118,9 +344,64 @@ public: // godot api
 	static bool chunk_exists(Vector2i chunk_coord);
 
 	static bool try_create_chunk(Vector2i chunk_coord);
+
+	static void set_unload_chunk_callback(Callable callback);
+	// Rounded down to a number of regions (~1mb each).
+	// Compressed regions count as a full region,
+	// so it does not depend on what was read and is the same for all peers.
+	static void set_memory_budget(i64 bytes);
+	static i64 get_memory_budget();
+	// Unload least recently stepped regions until under memory budget.
+	// Regions touching a keep rect (grown by 1 for neighbors) are never unloaded.
+	// Needs to be called while not stepping. Return the number of unloaded chunks.
+	static i64 unload_old_chunks(TypedArray<Rect2i> keep_rects);
+
+	static void set_compress_after_ticks(i64 value);
+	static i64 get_compress_after_ticks();
+	// Compress regions which have not been stepped for compress_after_ticks.
+	// Regions touching a keep rect (grown by 1 for neighbors) are never compressed.
+	// Neither are regions with a chunk holding cells_save, as it is not compressed.
+	// Needs to be called while not stepping. Return the number of compressed regions.
+	static i64 compress_old_chunks(TypedArray<Rect2i> keep_rects);
 	static void step_chunk(Vector2i chunk_coord);
+	static void set_generate_chunk_callback(Callable callback);
+	// Create missing chunks in rects grown by 1 and mark them to be generated.
+	// Needs to be called while not stepping.
+	static void prepare_step_rects(TypedArray<Rect2i> rects);
+	// Step every chunk in rects once on WorkerThreadPool.
+	// Same result as stepping them one after the other in 3 passes (x mod 3) of columns from bottom to top.
+	// Each chunk only waits on the chunks before it within 2 chunks.
+	// Chunks marked by prepare_step_rects are generated just before their first neighbor is stepped.
+	// Needs to be called between pre_step and post_step.
+	static void step_rects(TypedArray<Rect2i> rects);
+	// Same as step_rects, but only step chunks which are active or entering rects,
+	// so new chunks are not missed. Every chunk is stepped after a reaction changed.
+	// Costs about the number of active chunks plus those entering rects.
+	// At most max_chunks chunks are stepped when above 0.
+	// The others are deferred to the next calls, chunks in priority_rects first.
+	static void step_active_rects(
+			TypedArray<Rect2i> rects,
+			i64 max_chunks = 0,
+			TypedArray<Rect2i> priority_rects = TypedArray<Rect2i>());
+	// Chunks waiting for a step_active_rects with room in its budget.
+	static i64 get_num_deferred_chunks();
+	// Entries in the active set, which may include chunks not active anymore.
+	static i64 get_num_active_chunks();
 	static void pre_step();
 	static void post_step();
+	// Call step on its own thread without blocking.
+	// Needs the previous step to be finished.
+	static void start_step(Callable step);
+	static bool is_step_running();
+	// Return true once the previous step is finished and it is safe to modify Grid.
+	// Return false without blocking otherwise, so a slow step slows down the simulation instead of the game.
+	// A skipped tick is counted only when the next tick is waiting to be stepped.
+	static bool try_finish_step(bool tick_waiting = true);
+	// Block until the previous step is finished.
+	// Then link regions inflated while stepping.
+	static void finish_step();
+	// Number of skipped and late ticks since clear.
+	static Dictionary get_step_stats();
 
 	static bool randb();
 	static bool randb_probability(f32 probability);
@@ -83,10 +83,19 @@ void GridChunkIter::set_color(u32 color) {
 
 	if (Grid::get_cell_material(Cell::material_idx(*cell_ptr)).can_color) {
 		Cell::set_color(*cell_ptr, color);
+		chunk->cells_changed();
 	}
 }
 
 void GridChunkIter::fill_remaining(u32 material_idx) {
+	ERR_FAIL_COND_MSG(material_idx >= Grid::cell_materials.size(), "material_idx must be less than cell_materials.size");
+
+	if (x == -1 && y == 0 && Grid::cell_materials[material_idx].noise_darken_max == 0) {
+		// Every cell is the same, so keep the chunk uniform.
+		chunk->fill(material_idx);
+		return;
+	}
+
 	while (next()) {
 		set_material_idx(material_idx);
 	}
@@ -0,0 +1,290 @@
+#ifndef POOL_HPP
+#define POOL_HPP
+
+#include "core/os/memory.h"
+#include "core/os/spin_lock.h"
+#include "preludes.h"
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+// Allocate blocks of the same size from large pages.
+//
+// Blocks are aligned to cache line and recycled through an intrusive free list,
+// so chunks freed by the periodic sweep are reused instead of fragmenting the heap.
+// Pages are returned to the os by `trim` once all their blocks are free,
+// or right away by `free` with a single block per page.
+// A single block page starts with its index in pages, so freeing it does not search pages.
+// Blocks which may still be read by another thread are retired instead, see `reclaim`.
+// Thread safe. Each thread keeps a few free blocks, so step workers rarely share the lock.
+// Blocks cached by a thread are not returned to the os by `trim`.
+template <u64 BLOCK_SIZE, u64 BLOCKS_PER_PAGE>
+class BlockPool {
+	static_assert(BLOCK_SIZE % 64 == 0, "Block size needs to be a multiple of cache line");
+
+	// One cache line before the block with a single block per page.
+	static constexpr u64 PAGE_HEADER_SIZE = BLOCKS_PER_PAGE == 1 ? 64 : 0;
+	static constexpr u64 PAGE_SIZE = PAGE_HEADER_SIZE + BLOCK_SIZE * BLOCKS_PER_PAGE;
+
+	// Blocks moved between a thread's cache and the shared free list at once.
+	static constexpr u32 BATCH_SIZE = 16;
+
+	struct FreeBlock {
+		FreeBlock *next;
+	};
+
+	// Free blocks of a thread, so alloc and free only lock once per batch.
+	struct ThreadCache {
+		BlockPool *pool = nullptr;
+		u64 generation = 0;
+		FreeBlock *blocks = nullptr;
+		u32 num_blocks = 0;
+
+		// Threads like the step thread come and go, so blocks are given back when they exit.
+		~ThreadCache() {
+			if (pool != nullptr) {
+				pool->flush_cache(*this);
+			}
+		}
+	};
+
+	inline static thread_local ThreadCache thread_cache = {};
+
+	SpinLock lock;
+
+	std::vector<u8 *> pages = {};
+	FreeBlock *free_list = nullptr;
+	// Freed, but not reused until reclaim.
+	// Not an intrusive list, so their content is left untouched for readers.
+	std::vector<void *> retired = {};
+	std::atomic<u64> num_used = 0;
+	// Changed by release_all, which frees the pages of cached blocks too.
+	std::atomic<u64> generation = 0;
+
+	// Push every block of a new page on the free list.
+	void add_page() {
+		u8 *page = reinterpret_cast<u8 *>(Memory::alloc_aligned_static(PAGE_SIZE, 64));
+		CRASH_COND_MSG(page == nullptr, "Out of memory");
+		pages.push_back(page);
+
+		// In reverse so that blocks are handed out in address order.
+		for (u64 i = BLOCKS_PER_PAGE; i > 0; i--) {
+			FreeBlock *block = reinterpret_cast<FreeBlock *>(page + (i - 1) * BLOCK_SIZE);
+			block->next = free_list;
+			free_list = block;
+		}
+	}
+
+	// Give every block of cache back to the shared free list, unless their pages were released.
+	void flush_cache(ThreadCache &cache) {
+		lock.lock();
+		if (cache.generation == generation.load(std::memory_order_relaxed)) {
+			while (cache.blocks != nullptr) {
+				FreeBlock *block = cache.blocks;
+				cache.blocks = block->next;
+				block->next = free_list;
+				free_list = block;
+			}
+		}
+		lock.unlock();
+		cache.blocks = nullptr;
+		cache.num_blocks = 0;
+	}
+
+	// This thread's cache, emptied first if it was used by another pool or before release_all.
+	ThreadCache &get_cache() {
+		ThreadCache &cache = thread_cache;
+		u64 current = generation.load(std::memory_order_acquire);
+		if (cache.pool != this || cache.generation != current) {
+			if (cache.pool != nullptr) {
+				cache.pool->flush_cache(cache);
+			}
+			cache.pool = this;
+			cache.generation = current;
+		}
+		return cache;
+	}
+
+public:
+	// Uninitialized block of BLOCK_SIZE bytes aligned to 64.
+	void *alloc() {
+		if constexpr (BLOCKS_PER_PAGE == 1) {
+			lock.lock();
+			u8 *page = reinterpret_cast<u8 *>(Memory::alloc_aligned_static(PAGE_SIZE, 64));
+			CRASH_COND_MSG(page == nullptr, "Out of memory");
+			*reinterpret_cast<u64 *>(page) = pages.size();
+			pages.push_back(page);
+			num_used += 1;
+			lock.unlock();
+			return page + PAGE_HEADER_SIZE;
+		}
+
+		ThreadCache &cache = get_cache();
+		if (cache.blocks == nullptr) {
+			lock.lock();
+			if (free_list == nullptr) {
+				add_page();
+			}
+			while (free_list != nullptr && cache.num_blocks < BATCH_SIZE) {
+				FreeBlock *block = free_list;
+				free_list = block->next;
+				block->next = cache.blocks;
+				cache.blocks = block;
+				cache.num_blocks += 1;
+			}
+			lock.unlock();
+		}
+
+		FreeBlock *block = cache.blocks;
+		cache.blocks = block->next;
+		cache.num_blocks -= 1;
+		num_used.fetch_add(1, std::memory_order_relaxed);
+		return block;
+	}
+
+	// Block needs to come from this pool.
+	void free(void *ptr) {
+		TEST_ASSERT(ptr != nullptr, "free null block");
+
+		if constexpr (BLOCKS_PER_PAGE == 1) {
+			lock.lock();
+			// The page is empty now. Move the last page in its place.
+			u8 *page = reinterpret_cast<u8 *>(ptr) - PAGE_HEADER_SIZE;
+			u64 page_idx = *reinterpret_cast<u64 *>(page);
+			TEST_ASSERT(page_idx < pages.size() && pages[page_idx] == page, "block not from this pool");
+			u8 *last = pages.back();
+			*reinterpret_cast<u64 *>(last) = page_idx;
+			pages[page_idx] = last;
+			pages.pop_back();
+			Memory::free_aligned_static(page);
+			num_used -= 1;
+			lock.unlock();
+			return;
+		}
+
+		ThreadCache &cache = get_cache();
+		FreeBlock *block = reinterpret_cast<FreeBlock *>(ptr);
+		block->next = cache.blocks;
+		cache.blocks = block;
+		cache.num_blocks += 1;
+		num_used.fetch_sub(1, std::memory_order_relaxed);
+
+		// Keep a batch for the next allocs.
+		if (cache.num_blocks >= 2 * BATCH_SIZE) {
+			lock.lock();
+			while (cache.num_blocks > BATCH_SIZE) {
+				FreeBlock *given = cache.blocks;
+				cache.blocks = given->next;
+				given->next = free_list;
+				free_list = given;
+				cache.num_blocks -= 1;
+			}
+			lock.unlock();
+		}
+	}
+
+	// Free once no reader can hold ptr anymore, which is up to the caller of reclaim.
+	// Block needs to come from this pool.
+	void retire(void *ptr) {
+		static_assert(BLOCKS_PER_PAGE > 1, "single block pages are freed right away");
+		TEST_ASSERT(ptr != nullptr, "retire null block");
+
+		lock.lock();
+		retired.push_back(ptr);
+		num_used -= 1;
+		lock.unlock();
+	}
+
+	// Free every retired block.
+	void reclaim() {
+		lock.lock();
+		for (void *ptr : retired) {
+			FreeBlock *block = reinterpret_cast<FreeBlock *>(ptr);
+			block->next = free_list;
+			free_list = block;
+		}
+		retired.clear();
+		lock.unlock();
+	}
+
+	// Return pages whose blocks are all free to the os.
+	// Costs about the number of free blocks, so call it after freeing many.
+	void trim() {
+		lock.lock();
+		std::sort(pages.begin(), pages.end());
+		auto page_idx = [this](FreeBlock *block) {
+			return std::upper_bound(pages.begin(), pages.end(), reinterpret_cast<u8 *>(block)) - pages.begin() - 1;
+		};
+
+		std::vector<u32> num_free(pages.size(), 0);
+		for (FreeBlock *block = free_list; block != nullptr; block = block->next) {
+			num_free[page_idx(block)] += 1;
+		}
+
+		// Keep blocks of pages still in use.
+		FreeBlock *kept = nullptr;
+		FreeBlock *block = free_list;
+		while (block != nullptr) {
+			FreeBlock *next = block->next;
+			if (num_free[page_idx(block)] != BLOCKS_PER_PAGE) {
+				block->next = kept;
+				kept = block;
+			}
+			block = next;
+		}
+		free_list = kept;
+
+		u64 num_kept = 0;
+		for (u64 i = 0; i < pages.size(); i++) {
+			if (num_free[i] == BLOCKS_PER_PAGE) {
+				Memory::free_aligned_static(pages[i]);
+			} else {
+				pages[num_kept] = pages[i];
+				num_kept += 1;
+			}
+		}
+		pages.resize(num_kept);
+		lock.unlock();
+	}
+
+	// Free every page at once.
+	// Any block still in use becomes dangling and is not destructed.
+	void release_all() {
+		lock.lock();
+		for (u8 *page : pages) {
+			Memory::free_aligned_static(page);
+		}
+		pages.clear();
+		pages.shrink_to_fit();
+		free_list = nullptr;
+		retired.clear();
+		num_used = 0;
+		// Cached blocks are dropped by their thread on its next use.
+		generation.fetch_add(1, std::memory_order_release);
+		lock.unlock();
+	}
+
+	// Bytes handed out.
+	inline i64 get_used_bytes() {
+		return i64(num_used.load(std::memory_order_relaxed) * BLOCK_SIZE);
+	}
+
+	// Bytes held by this pool including free blocks.
+	inline i64 get_reserved_bytes() {
+		return i64(pages.size() * PAGE_SIZE + pages.capacity() * sizeof(u8 *));
+	}
+
+	inline u64 get_num_used() {
+		return num_used.load(std::memory_order_relaxed);
+	}
+
+	BlockPool() {}
+	BlockPool(const BlockPool &) = delete;
+	BlockPool &operator=(const BlockPool &) = delete;
+
+	~BlockPool() {
+		release_all();
+	}
+};
+
+#endif
@@ -0,0 +1,356 @@
+#ifndef REGION_HPP
+#define REGION_HPP
+
+#include "chunk.h"
+#include "core/math/vector2i.h"
+#include "core/os/memory.h"
+#include "preludes.h"
+#include <atomic>
+#include <cstring>
+#include <vector>
+
+// Number of chunks per side of a region.
+const i32 REGION_SIZE = 16;
+const i32 REGION_SIZE_SHIFT = 4;
+const i32 REGION_NUM_CHUNKS = REGION_SIZE * REGION_SIZE;
+// Bytes of a resident region's chunk storage.
+const u64 REGION_BLOCK_SIZE = REGION_NUM_CHUNKS * sizeof(Chunk);
+// Bytes of a resident region whose chunks all have cells.
+const u64 REGION_MAX_SIZE = REGION_BLOCK_SIZE + REGION_NUM_CHUNKS * 32 * 32 * sizeof(u32);
+
+// A square of chunks.
+//
+// While resident, chunk headers are stored contiguously in a block from Grid's region pool.
+// They are laid out in morton order, so the headers of a 3x3 neighborhood usually stay within a few pages.
+// Cells are in their own blocks from Chunk::buffer_pool and get no such locality.
+//
+// A region which has not been stepped for a while can be compressed:
+// its block is freed and each chunk is kept as a palette of cell values
+// and bit-packed indices into that palette.
+struct Region {
+	Vector2i region_coord;
+
+	u32 num_chunks = 0;
+	// Bit per slot. Set when a chunk is constructed in that slot.
+	// Kept while compressed.
+	u64 occupied[REGION_NUM_CHUNKS / 64] = {};
+
+	// Block of REGION_NUM_CHUNKS chunks. Uninitialized until a chunk is created.
+	// Null while compressed.
+	std::atomic<Chunk *> chunks = nullptr;
+
+	// Empty while resident.
+	std::vector<u8> compressed = {};
+	// Start of each occupied slot's data in compressed.
+	std::vector<u32> compressed_offsets = {};
+	// Last tick any of its chunks was stepped. Set by Grid::step_chunks, kept while compressed.
+	i64 last_step_tick = -1;
+	// cells_version of all its chunks while compressed.
+	u64 compressed_cells_version = 0;
+
+	// Stored in front of each compressed chunk.
+	struct CompressedChunkHeader {
+		i64 last_step_tick;
+		u32 active_rows;
+		u32 active_columns;
+		u32 num_background_cell;
+		u32 has_background;
+		// Chunks created around step rects may not be generated yet.
+		u32 needs_generation;
+	};
+
+	inline static Vector2i to_region_coord(Vector2i chunk_coord) {
+		// Arithmetic shift rounds toward negative infinity.
+		return Vector2i(chunk_coord.x >> REGION_SIZE_SHIFT, chunk_coord.y >> REGION_SIZE_SHIFT);
+	}
+
+	// Interleave the bits of the chunk's coord within its region.
+	inline static u32 to_slot(Vector2i chunk_coord) {
+		u32 x = u32(chunk_coord.x) & (REGION_SIZE - 1);
+		u32 y = u32(chunk_coord.y) & (REGION_SIZE - 1);
+
+		x = (x | (x << 2)) & 0x33;
+		x = (x | (x << 1)) & 0x55;
+		y = (y | (y << 2)) & 0x33;
+		y = (y | (y << 1)) & 0x55;
+
+		return x | (y << 1);
+	}
+
+	// Inverse of `to_slot`.
+	inline Vector2i slot_chunk_coord(u32 slot) {
+		u32 x = slot & 0x55;
+		u32 y = (slot >> 1) & 0x55;
+
+		x = (x | (x >> 1)) & 0x33;
+		x = (x | (x >> 2)) & 0x0F;
+		y = (y | (y >> 1)) & 0x33;
+		y = (y | (y >> 2)) & 0x0F;
+
+		return region_coord * REGION_SIZE + Vector2i(i32(x), i32(y));
+	}
+
+	inline bool is_occupied(u32 slot) {
+		return (occupied[slot >> 6] & (1uLL << (slot & 63))) != 0;
+	}
+
+	inline bool is_resident() {
+		return chunks.load(std::memory_order_acquire) != nullptr;
+	}
+
+	// Return nullptr if there is no chunk in slot or region is compressed.
+	inline Chunk *get_chunk(u32 slot) {
+		TEST_ASSERT(slot < REGION_NUM_CHUNKS, "slot out of bound");
+
+		Chunk *block = chunks.load(std::memory_order_acquire);
+		if (block != nullptr && is_occupied(slot)) {
+			return block + slot;
+		} else {
+			return nullptr;
+		}
+	}
+
+	// Slot needs to be free and region resident.
+	inline Chunk *create_chunk(u32 slot) {
+		TEST_ASSERT(!is_occupied(slot), "slot is occupied");
+		TEST_ASSERT(is_resident(), "region is compressed");
+
+		occupied[slot >> 6] |= 1uLL << (slot & 63);
+		num_chunks += 1;
+		return memnew_placement(chunks.load(std::memory_order_relaxed) + slot, Chunk);
+	}
+
+	// Slot needs to be occupied and region resident.
+	inline void destroy_chunk(u32 slot) {
+		TEST_ASSERT(is_occupied(slot), "slot is not occupied");
+		TEST_ASSERT(is_resident(), "region is compressed");
+
+		(chunks.load(std::memory_order_relaxed) + slot)->~Chunk();
+		occupied[slot >> 6] &= ~(1uLL << (slot & 63));
+		num_chunks -= 1;
+	}
+
+	// Smallest of 0, 1, 2, 4 or 8 bits which can index palette.
+	// Indices never straddle a byte.
+	inline static u32 index_bits(u32 palette_size) {
+		u32 bits = 0;
+		while ((1u << bits) < palette_size) {
+			bits = bits == 0 ? 1 : bits * 2;
+		}
+		return bits;
+	}
+
+	// Palette followed by bit-packed indices.
+	// Bits per index is 0, 1, 2, 4 or 8. Raw cells if there are more than 256 values.
+	inline static void encode_cells(const u32 *cells, std::vector<u8> &out) {
+		u32 palette[256];
+		u32 palette_size = 0;
+		u8 indices[32 * 32];
+
+		u32 last_idx = 0;
+		for (u32 i = 0; i < 32 * 32; i++) {
+			u32 cell = cells[i];
+			// Cells often repeat.
+			if (palette_size > 0 && palette[last_idx] == cell) {
+				indices[i] = u8(last_idx);
+				continue;
+			}
+
+			u32 idx = 0;
+			while (idx < palette_size && palette[idx] != cell) {
+				idx += 1;
+			}
+			if (idx == palette_size) {
+				if (palette_size == 256) {
+					palette_size = 0;
+					break;
+				}
+				palette[palette_size] = cell;
+				palette_size += 1;
+			}
+			indices[i] = u8(idx);
+			last_idx = idx;
+		}
+
+		u64 start = out.size();
+		if (palette_size == 0) {
+			// Too many different cells.
+			out.resize(start + sizeof(u32) + 32 * 32 * sizeof(u32));
+			std::memset(out.data() + start, 0, sizeof(u32));
+			std::memcpy(out.data() + start + sizeof(u32), cells, 32 * 32 * sizeof(u32));
+			return;
+		}
+
+		u32 bits = index_bits(palette_size);
+
+		u64 packed_size = 32 * 32 * bits / 8;
+		out.resize(start + sizeof(u32) + palette_size * sizeof(u32) + packed_size);
+		u8 *ptr = out.data() + start;
+		std::memcpy(ptr, &palette_size, sizeof(u32));
+		ptr += sizeof(u32);
+		std::memcpy(ptr, palette, palette_size * sizeof(u32));
+		ptr += palette_size * sizeof(u32);
+
+		if (bits > 0) {
+			std::memset(ptr, 0, packed_size);
+			u32 per_byte = 8 / bits;
+			for (u32 i = 0; i < 32 * 32; i++) {
+				ptr[i / per_byte] |= u8(indices[i] << ((i % per_byte) * bits));
+			}
+		}
+	}
+
+	// Same as encoding 32 * 32 times the same cell.
+	inline static void encode_uniform(u32 cell, std::vector<u8> &out) {
+		u32 palette_size = 1;
+		u64 start = out.size();
+		out.resize(start + 2 * sizeof(u32));
+		std::memcpy(out.data() + start, &palette_size, sizeof(u32));
+		std::memcpy(out.data() + start + sizeof(u32), &cell, sizeof(u32));
+	}
+
+	// Return true and set cell if every encoded cell is the same.
+	inline static bool decode_uniform(const u8 *data, u32 &cell) {
+		u32 palette_size;
+		std::memcpy(&palette_size, data, sizeof(u32));
+		if (palette_size != 1) {
+			return false;
+		}
+
+		std::memcpy(&cell, data + sizeof(u32), sizeof(u32));
+		return true;
+	}
+
+	// Return the end of the encoded cells.
+	inline static const u8 *skip_cells(const u8 *data) {
+		u32 palette_size;
+		std::memcpy(&palette_size, data, sizeof(u32));
+		data += sizeof(u32);
+
+		if (palette_size == 0) {
+			return data + 32 * 32 * sizeof(u32);
+		}
+
+		u32 bits = index_bits(palette_size);
+		return data + palette_size * sizeof(u32) + 32 * 32 * bits / 8;
+	}
+
+	// Return the end of the encoded cells.
+	inline static const u8 *decode_cells(const u8 *data, u32 *cells) {
+		u32 palette_size;
+		std::memcpy(&palette_size, data, sizeof(u32));
+		data += sizeof(u32);
+
+		if (palette_size == 0) {
+			std::memcpy(cells, data, 32 * 32 * sizeof(u32));
+			return data + 32 * 32 * sizeof(u32);
+		}
+
+		u32 palette[256];
+		std::memcpy(palette, data, palette_size * sizeof(u32));
+		data += palette_size * sizeof(u32);
+
+		u32 bits = index_bits(palette_size);
+
+		if (bits == 0) {
+			for (u32 i = 0; i < 32 * 32; i++) {
+				cells[i] = palette[0];
+			}
+			return data;
+		}
+
+		u32 per_byte = 8 / bits;
+		u32 mask = (1u << bits) - 1;
+		for (u32 i = 0; i < 32 * 32; i++) {
+			cells[i] = palette[(data[i / per_byte] >> ((i % per_byte) * bits)) & mask];
+		}
+		return data + 32 * 32 * bits / 8;
+	}
+
+	inline static void encode_chunk(Chunk *chunk, std::vector<u8> &out) {
+		CompressedChunkHeader header = {
+			chunk->last_step_tick,
+			chunk->active_rows,
+			chunk->active_columns,
+			chunk->num_background_cell,
+			!chunk->background.is_empty(),
+			chunk->needs_generation,
+		};
+		u64 start = out.size();
+		out.resize(start + sizeof(CompressedChunkHeader));
+		std::memcpy(out.data() + start, &header, sizeof(CompressedChunkHeader));
+
+		if (chunk->is_uniform()) {
+			encode_uniform(chunk->uniform_cell.load(std::memory_order_relaxed), out);
+		} else {
+			encode_cells(chunk->cells.load(std::memory_order_relaxed), out);
+		}
+		if (!chunk->background.is_empty()) {
+			u32 background[32 * 32];
+			chunk->background.decode(background);
+			encode_cells(background, out);
+		}
+	}
+
+	// Chunk needs to be newly constructed.
+	inline static void decode_chunk(const u8 *data, Chunk *chunk) {
+		CompressedChunkHeader header;
+		std::memcpy(&header, data, sizeof(CompressedChunkHeader));
+		data += sizeof(CompressedChunkHeader);
+
+		chunk->last_step_tick = header.last_step_tick;
+		chunk->active_rows = header.active_rows;
+		chunk->active_columns = header.active_columns;
+		chunk->fill_active_cells();
+		chunk->needs_generation = header.needs_generation != 0;
+
+		// Chunks which became uniform are not materialized.
+		u32 uniform_cell = 0;
+		if (decode_uniform(data, uniform_cell)) {
+			chunk->uniform_cell.store(uniform_cell, std::memory_order_relaxed);
+			data = skip_cells(data);
+		} else {
+			u32 *cells = reinterpret_cast<u32 *>(Chunk::buffer_pool.alloc());
+			data = decode_cells(data, cells);
+			chunk->cells.store(cells, std::memory_order_relaxed);
+		}
+		if (header.has_background) {
+			u32 background[32 * 32];
+			decode_cells(data, background);
+			chunk->background.load(background);
+		}
+		chunk->num_background_cell = header.num_background_cell;
+	}
+
+	// Decode cells or background of a compressed chunk without inflating it.
+	// Return nullptr and set uniform_cell if every cell is the same.
+	// Return nullptr and set uniform_cell to 0 if there is no background.
+	inline const u32 *decode_compressed_cells(u32 slot, bool background, u32 *out, u32 &uniform_cell) {
+		TEST_ASSERT(is_occupied(slot), "slot is not occupied");
+		TEST_ASSERT(!compressed.empty(), "region is not compressed");
+
+		const u8 *data = compressed.data() + compressed_offsets[slot];
+		CompressedChunkHeader header;
+		std::memcpy(&header, data, sizeof(CompressedChunkHeader));
+		data += sizeof(CompressedChunkHeader);
+
+		if (background) {
+			if (!header.has_background) {
+				uniform_cell = 0;
+				return nullptr;
+			}
+			data = skip_cells(data);
+		}
+		if (decode_uniform(data, uniform_cell)) {
+			return nullptr;
+		}
+		decode_cells(data, out);
+		return out;
+	}
+
+	inline i64 get_compressed_memory_usage() {
+		return i64(compressed.capacity() + compressed_offsets.capacity() * sizeof(u32));
+	}
+};
+
+#endif
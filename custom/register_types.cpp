@@ -1,4 +1,5 @@
 #include "register_types.h"
+#include "cell_buffer.h"
 #include "core/object/class_db.h"
 #include "grid.h"
 #include "grid_body.h"
@@ -21,6 +22,7 @@ void initialize_custom_module(ModuleInitializationLevel p_level) {
 	ClassDB::register_class<GridLineIter>();
 	ClassDB::register_class<GridFillIter>();
 
+	ClassDB::register_class<CellBuffer>();
 	ClassDB::register_class<GridBody>();
 	ClassDB::register_class<RectQuery>();
 }
@@ -29,4 +31,6 @@ void uninitialize_custom_module(ModuleInitializationLevel p_level) {
 	if (p_level != MODULE_INITIALIZATION_LEVEL_SCENE) {
 		return;
 	}
+
+	Grid::finish_step();
 }
@@ -1,10 +1,30 @@
 #include "tests.h"
+#include "cell.hpp"
+#include "cell_buffer.h"
+#include "cell_material.hpp"
+#include "chunk.h"
+#include "chunk_table.hpp"
+#include "core/io/image.h"
 #include "core/math/rect2i.h"
 #include "core/math/vector2i.h"
+#include "core/object/callable_method_pointer.h"
+#include "core/object/worker_thread_pool.h"
+#include "core/os/memory.h"
 #include "core/os/time.h"
 #include "core/string/print_string.h"
+#include "core/templates/vector.h"
+#include "core/variant/typed_array.h"
+#include "grid.h"
 #include "preludes.h"
+#include "region.hpp"
 #include "rng.hpp"
+#include <atomic>
+#include <unordered_map>
+#include <vector>
+
+u64 test_chunk_id(Vector2i chunk_coord) {
+	return u64(u32(chunk_coord.x)) | (u64(u32(chunk_coord.y)) << 32);
+}
 
 void test_count_zero() {
 	TEST_ASSERT(countr_zero(0b00000000) == 32, "countr zero");
@@ -236,6 +256,1095 @@ void test_rng_bias() {
 	TEST_ASSERT(float_bias != 0.5, "rng float bias is 0.5");
 }
 
+void test_chunk_table() {
+	const i32 SIZE = 64;
+	std::vector<u64> values(SIZE * SIZE);
+	ChunkTable<u64> table;
+
+	TEST_ASSERT(table.get(0) == nullptr, "empty table get");
+	TEST_ASSERT(!table.erase(0), "empty table erase");
+
+	for (i32 y = 0; y < SIZE; y++) {
+		for (i32 x = 0; x < SIZE; x++) {
+			u64 **value = table.try_insert(test_chunk_id(Vector2i(x - SIZE / 2, y - SIZE / 2)));
+			TEST_ASSERT(value != nullptr, "insert new key");
+			*value = &values[x + y * SIZE];
+		}
+	}
+	TEST_ASSERT(table.size() == SIZE * SIZE, "size after insert");
+	TEST_ASSERT(table.try_insert(test_chunk_id(Vector2i(0, 0))) == nullptr, "insert existing key");
+
+	// Erase every other chunk.
+	for (i32 y = 0; y < SIZE; y++) {
+		for (i32 x = (y & 1); x < SIZE; x += 2) {
+			TEST_ASSERT(table.erase(test_chunk_id(Vector2i(x - SIZE / 2, y - SIZE / 2))), "erase");
+		}
+	}
+	TEST_ASSERT(table.size() == SIZE * SIZE / 2, "size after erase");
+
+	for (i32 y = 0; y < SIZE; y++) {
+		for (i32 x = 0; x < SIZE; x++) {
+			u64 *value = table.get(test_chunk_id(Vector2i(x - SIZE / 2, y - SIZE / 2)));
+			if (((x + y) & 1) == 0) {
+				TEST_ASSERT(value == nullptr, "erased key found");
+			} else {
+				TEST_ASSERT(value == &values[x + y * SIZE], "wrong value");
+			}
+		}
+	}
+	TEST_ASSERT(table.get(test_chunk_id(Vector2i(SIZE, SIZE))) == nullptr, "missing key found");
+
+	u64 num_iter = 0;
+	for (u64 *value : table) {
+		TEST_ASSERT(value != nullptr, "iter null value");
+		num_iter += 1;
+	}
+	TEST_ASSERT(num_iter == table.size(), "iter count");
+
+	// Reinsert over deleted slots.
+	for (i32 y = 0; y < SIZE; y++) {
+		for (i32 x = (y & 1); x < SIZE; x += 2) {
+			u64 **value = table.try_insert(test_chunk_id(Vector2i(x - SIZE / 2, y - SIZE / 2)));
+			TEST_ASSERT(value != nullptr, "reinsert");
+			*value = &values[x + y * SIZE];
+		}
+	}
+	for (i32 i = 0; i < SIZE * SIZE; i++) {
+		TEST_ASSERT(table.get(test_chunk_id(Vector2i(i % SIZE - SIZE / 2, i / SIZE - SIZE / 2))) == &values[i], "get after reinsert");
+	}
+
+	table.clear();
+	TEST_ASSERT(table.size() == 0, "size after clear");
+	TEST_ASSERT(table.get(test_chunk_id(Vector2i(0, 0))) == nullptr, "get after clear");
+}
+
+void test_region_slot() {
+	bool used[REGION_NUM_CHUNKS] = {};
+	for (i32 y = 0; y < REGION_SIZE; y++) {
+		for (i32 x = 0; x < REGION_SIZE; x++) {
+			u32 slot = Region::to_slot(Vector2i(x, y));
+			TEST_ASSERT(slot < REGION_NUM_CHUNKS, "slot out of bound");
+			TEST_ASSERT(!used[slot], "slot used twice");
+			used[slot] = true;
+
+			Vector2i chunk_coord = Vector2i(x - REGION_SIZE * 3, y + REGION_SIZE * 2);
+			TEST_ASSERT(Region::to_slot(chunk_coord) == slot, "slot depends on region");
+			TEST_ASSERT(Region::to_region_coord(chunk_coord) == Vector2i(-3, 2), "wrong region coord");
+		}
+	}
+	TEST_ASSERT(Region::to_slot(Vector2i(1, 1)) == 3, "not morton order");
+	TEST_ASSERT(Region::to_region_coord(Vector2i(-1, -17)) == Vector2i(-1, -2), "wrong negative region coord");
+}
+
+void test_chunk_neighbors() {
+	Grid::clear();
+
+	// Create chunks in a scattered order and across region borders.
+	for (i32 i = 0; i < 16; i++) {
+		i32 j = (i * 7) % 16;
+		TEST_ASSERT(Grid::try_create_chunk(Vector2i(j % 4 - 2, j / 4 - 2)), "chunk already exists");
+	}
+	TEST_ASSERT(!Grid::try_create_chunk(Vector2i(-1, 1)), "chunk created twice");
+
+	for (i32 y = -2; y < 2; y++) {
+		for (i32 x = -2; x < 2; x++) {
+			Chunk *chunk = Grid::get_chunk(Vector2i(x, y));
+			TEST_ASSERT(chunk->chunk_coord == Vector2i(x, y), "wrong chunk coord");
+			bool inner = x > -2 && x < 1 && y > -2 && y < 1;
+			TEST_ASSERT(chunk->has_all_neighbors() == inner, "wrong has_all_neighbors");
+			TEST_ASSERT(chunk->neighbors[4] == chunk, "center is not self");
+
+			for (i32 i = 0; i < 9; i++) {
+				Vector2i other_coord = Vector2i(x + i % 3 - 1, y + i / 3 - 1);
+				TEST_ASSERT(chunk->neighbors[i] == Grid::get_chunk(other_coord), "wrong neighbor");
+			}
+		}
+	}
+
+	Chunk *chunk = Grid::get_chunk(Vector2i(-1, -1));
+	chunk->unlink_neighbors();
+	TEST_ASSERT(Grid::get_chunk(Vector2i(-2, -2))->neighbors[8] == nullptr, "neighbor not unlinked");
+	TEST_ASSERT(!Grid::get_chunk(Vector2i(0, 0))->has_all_neighbors(), "neighbor not unlinked");
+	chunk->link_neighbors();
+	TEST_ASSERT(Grid::get_chunk(Vector2i(0, 0))->has_all_neighbors(), "neighbor not relinked");
+
+	Grid::clear();
+}
+
+void test_unload_old_chunks() {
+	Grid::clear();
+	i64 old_budget = Grid::get_memory_budget();
+	Grid::set_memory_budget(i64(3 * REGION_MAX_SIZE));
+
+	// One chunk in each of 4 regions on the same row.
+	const i64 TICKS[4] = { 5, 1, 3, 0 };
+	for (i32 i = 0; i < 4; i++) {
+		Vector2i chunk_coord = Vector2i(REGION_SIZE * i, 0);
+		Grid::try_create_chunk(chunk_coord);
+		Grid::get_region(chunk_coord)->last_step_tick = TICKS[i];
+	}
+
+	// Last region is the oldest, but kept as it touches the rect.
+	TypedArray<Rect2i> keep_rects = TypedArray<Rect2i>();
+	keep_rects.push_back(Rect2i(REGION_SIZE * 3 + 5, 0, 1, 1));
+
+	// Over budget by one region. The oldest unkept one goes first.
+	TEST_ASSERT(Grid::unload_old_chunks(keep_rects) == 1, "wrong number of unloaded chunks");
+	TEST_ASSERT(!Grid::chunk_exists(Vector2i(REGION_SIZE, 0)), "oldest region not unloaded");
+	TEST_ASSERT(Grid::chunk_exists(Vector2i(0, 0)), "newer region unloaded");
+	TEST_ASSERT(Grid::chunk_exists(Vector2i(REGION_SIZE * 2, 0)), "newer region unloaded");
+	TEST_ASSERT(Grid::chunk_exists(Vector2i(REGION_SIZE * 3, 0)), "kept region unloaded");
+
+	TEST_ASSERT(Grid::unload_old_chunks(keep_rects) == 0, "unloaded while under budget");
+
+	// Then the next oldest.
+	Grid::set_memory_budget(i64(2 * REGION_MAX_SIZE));
+	TEST_ASSERT(Grid::unload_old_chunks(keep_rects) == 1, "wrong number of unloaded chunks");
+	TEST_ASSERT(!Grid::chunk_exists(Vector2i(REGION_SIZE * 2, 0)), "oldest region not unloaded");
+	TEST_ASSERT(Grid::chunk_exists(Vector2i(0, 0)), "newest region unloaded");
+	TEST_ASSERT(Grid::chunk_exists(Vector2i(REGION_SIZE * 3, 0)), "kept region unloaded");
+
+	Grid::set_memory_budget(old_budget);
+	Grid::clear();
+}
+
+void test_region_encode_cells() {
+	Rng rng = Rng(7);
+	u32 cells[32 * 32];
+	u32 decoded[32 * 32];
+
+	const u32 NUM_VALUES[7] = { 1, 2, 3, 17, 256, 257, 1024 };
+	for (u32 num_values : NUM_VALUES) {
+		for (u32 i = 0; i < 32 * 32; i++) {
+			cells[i] = i < num_values ? i * 0x10001 : rng.gen_range_u32(0, num_values) * 0x10001;
+		}
+
+		std::vector<u8> data = {};
+		Region::encode_cells(cells, data);
+		TEST_ASSERT(Region::skip_cells(data.data()) == data.data() + data.size(), "wrong encoded size");
+		TEST_ASSERT(Region::decode_cells(data.data(), decoded) == data.data() + data.size(), "wrong decoded size");
+		for (u32 i = 0; i < 32 * 32; i++) {
+			TEST_ASSERT(decoded[i] == cells[i], "wrong decoded cell");
+		}
+	}
+}
+
+void test_compress_region() {
+	Grid::clear();
+	Grid::set_tick(100);
+
+	// Across 2 regions.
+	Rng rng = Rng(3);
+	for (i32 y = 0; y < 3; y++) {
+		for (i32 x = 14; x < 18; x++) {
+			Vector2i chunk_coord = Vector2i(x, y);
+			Grid::try_create_chunk(chunk_coord);
+			Chunk *chunk = Grid::get_chunk(chunk_coord);
+			chunk->last_step_tick = x + y;
+			Grid::get_region(chunk_coord)->last_step_tick = 100;
+			chunk->materialize();
+			for (u32 i = 0; i < 32 * 32; i++) {
+				// From 1 to 32 different cells.
+				chunk->cells[i] = rng.gen_range_u32(0, 1u << (x + y - 14));
+			}
+			if (x == 15) {
+				chunk->set_background(Vector2i(x, y), 7);
+			}
+		}
+	}
+
+	std::vector<u32> saved = {};
+	for (i32 y = 0; y < 3; y++) {
+		for (i32 x = 14; x < 18; x++) {
+			Chunk *chunk = Grid::get_chunk(Vector2i(x, y));
+			u32 *cells = chunk->cells.load();
+			saved.insert(saved.end(), cells, cells + 32 * 32);
+		}
+	}
+
+	TypedArray<Rect2i> keep_rects = TypedArray<Rect2i>();
+	keep_rects.push_back(Rect2i(15, 1, 1, 1));
+	TEST_ASSERT(Grid::compress_old_chunks(keep_rects) == 0, "kept region compressed");
+
+	Grid::set_tick(99 + Grid::get_compress_after_ticks());
+	TEST_ASSERT(Grid::compress_old_chunks(TypedArray<Rect2i>()) == 0, "recently stepped region compressed");
+
+	i64 memory_usage = Grid::get_grid_memory_usage();
+	Grid::set_tick(100 + Grid::get_compress_after_ticks());
+	TEST_ASSERT(Grid::compress_old_chunks(TypedArray<Rect2i>()) == 2, "regions not compressed");
+	TEST_ASSERT(Grid::get_grid_memory_usage() < memory_usage, "compression did not free memory");
+	TEST_ASSERT(Grid::get_chunk_resident(Vector2i(15, 1)) == nullptr, "chunk still resident");
+	TEST_ASSERT(Grid::chunk_exists(Vector2i(15, 1)), "compressed chunk does not exist");
+	TEST_ASSERT(Grid::get_chunk_resident(Vector2i(15, 1)) == nullptr, "chunk_exists inflated");
+
+	// Inflate first region only.
+	TEST_ASSERT(!Grid::try_create_chunk(Vector2i(15, 1)), "compressed chunk created");
+	TEST_ASSERT(Grid::get_chunk_resident(Vector2i(16, 1)) == nullptr, "other region inflated");
+	TEST_ASSERT(!Grid::get_chunk(Vector2i(15, 1))->has_all_neighbors(), "compressed neighbor linked");
+
+	// Inflate second region.
+	TEST_ASSERT(Grid::get_chunk(Vector2i(16, 1)) != nullptr, "compressed chunk not found");
+	TEST_ASSERT(Grid::get_chunk(Vector2i(15, 1))->has_all_neighbors(), "neighbors not relinked");
+	TEST_ASSERT(Grid::get_chunk(Vector2i(15, 1))->neighbors[5] == Grid::get_chunk(Vector2i(16, 1)), "neighbors not relinked");
+
+	u32 i = 0;
+	for (i32 y = 0; y < 3; y++) {
+		for (i32 x = 14; x < 18; x++) {
+			Chunk *chunk = Grid::get_chunk(Vector2i(x, y));
+			TEST_ASSERT(chunk->chunk_coord == Vector2i(x, y), "wrong chunk coord");
+			TEST_ASSERT(chunk->last_step_tick == x + y, "wrong last_step_tick");
+			TEST_ASSERT(chunk->num_background_cell == u32(x == 15), "wrong num_background_cell");
+			TEST_ASSERT(chunk->get_background(Vector2i(x, y)) == (x == 15 ? 7 : 0), "wrong background");
+			// Chunks with a single value are inflated as uniform.
+			TEST_ASSERT(chunk->is_uniform() == (x + y == 14), "wrong uniform");
+			for (u32 j = 0; j < 32 * 32; j++) {
+				TEST_ASSERT(chunk->get_cell(Vector2i(j % 32, j / 32)) == saved[i], "wrong inflated cell");
+				i += 1;
+			}
+		}
+	}
+
+	Grid::clear();
+}
+
+void test_compress_active_chunk() {
+	Grid::clear();
+	Grid::try_create_chunk(Vector2i(0, 0));
+	Grid::get_chunk(Vector2i(0, 0))->activate_point(Vector2i(1, 1), false);
+	TEST_ASSERT(Grid::get_num_active_chunks() == 1, "chunk not in active set");
+
+	// Compressed chunks leave the active set and come back once inflated, only once.
+	for (i32 i = 1; i <= 2; i++) {
+		Grid::set_tick(Grid::get_compress_after_ticks() * i + 1);
+		TEST_ASSERT(Grid::compress_old_chunks(TypedArray<Rect2i>()) == 1, "region not compressed");
+		TEST_ASSERT(Grid::get_num_active_chunks() == 0, "compressed chunk still in active set");
+		TEST_ASSERT(Grid::get_chunk(Vector2i(0, 0))->in_active_set, "inflated chunk not in active set");
+		TEST_ASSERT(Grid::get_num_active_chunks() == 1, "inflated chunk in active set twice");
+	}
+
+	Grid::clear();
+}
+
+void test_compress_ungenerated_chunk() {
+	Grid::clear();
+
+	// Neighbors of the rect are created, but only generated once stepped next to.
+	TypedArray<Rect2i> rects = TypedArray<Rect2i>();
+	rects.push_back(Rect2i(0, 0, 1, 1));
+	Grid::prepare_step_rects(rects);
+	TEST_ASSERT(Grid::get_chunk(Vector2i(-1, -1))->needs_generation, "new chunk not marked");
+
+	Grid::set_tick(Grid::get_compress_after_ticks() + 1);
+	TEST_ASSERT(Grid::compress_old_chunks(TypedArray<Rect2i>()) == 4, "regions not compressed");
+	TEST_ASSERT(Grid::get_chunk_resident(Vector2i(-1, -1)) == nullptr, "chunk still resident");
+	TEST_ASSERT(Grid::get_chunk(Vector2i(-1, -1))->needs_generation, "ungenerated chunk inflated as generated");
+	TEST_ASSERT(Grid::get_chunk(Vector2i(1, 1))->needs_generation, "ungenerated chunk inflated as generated");
+
+	Grid::clear();
+}
+
+void test_uniform_chunk() {
+	Grid::clear();
+
+	TEST_ASSERT(Grid::try_create_chunk(Vector2i(0, 0)), "chunk already exists");
+	Chunk *chunk = Grid::get_chunk(Vector2i(0, 0));
+	TEST_ASSERT(chunk->is_uniform(), "new chunk is not uniform");
+	TEST_ASSERT(chunk->get_cell(Vector2i(31, 31)) == 0, "new chunk is not empty");
+
+	chunk->fill(5);
+	chunk->set_cell(Vector2i(3, 4), 5);
+	chunk->activate_all(true);
+	TEST_ASSERT(chunk->is_uniform(), "materialized without change");
+
+	u32 active_cell = 5;
+	Cell::set_active(active_cell);
+	TEST_ASSERT(chunk->get_cell(Vector2i(31, 0)) == active_cell, "uniform cell not activated");
+
+	// Rect across the chunk border.
+	Ref<Image> image = Grid::get_cell_buffer(Rect2i(-2, 30, 4, 2), false, true);
+	Vector<u8> data = image->get_data();
+	const u32 *pixels = reinterpret_cast<const u32 *>(data.ptr());
+	for (i32 i = 0; i < 8; i++) {
+		TEST_ASSERT(pixels[i] == ((i % 4) < 2 ? 0 : 5), "wrong uniform cell buffer");
+	}
+
+	chunk->set_cell(Vector2i(3, 4), 6);
+	TEST_ASSERT(!chunk->is_uniform(), "not materialized on write");
+	TEST_ASSERT(chunk->get_cell(Vector2i(3, 4)) == 6, "wrong written cell");
+	TEST_ASSERT(chunk->get_cell(Vector2i(4, 4)) == active_cell, "wrong materialized cell");
+
+	chunk->fill(7);
+	TEST_ASSERT(chunk->is_uniform(), "not uniform after fill");
+	TEST_ASSERT(Chunk::buffer_pool.get_num_used() == 0, "cells not freed");
+
+	Grid::clear();
+}
+
+void test_retired_blocks() {
+	Grid::clear();
+	Grid::try_create_chunk(Vector2i(0, 0));
+	Chunk *chunk = Grid::get_chunk(Vector2i(0, 0));
+
+	// A reader may still hold retired cells, so they are not reused.
+	chunk->set_cell(Vector2i(1, 1), 3);
+	u32 *retired_cells = chunk->cells;
+	chunk->fill(0);
+	chunk->set_cell(Vector2i(1, 1), 3);
+	TEST_ASSERT(chunk->cells != retired_cells, "retired cells reused");
+	TEST_ASSERT(retired_cells[1 + 32] == 3, "retired cells overwritten");
+
+	chunk->fill(0);
+	Grid::reclaim_retired_blocks();
+	chunk->set_cell(Vector2i(1, 1), 3);
+	TEST_ASSERT(Chunk::buffer_pool.get_num_used() == 1, "retired cells counted as used");
+
+	chunk->set_background(Vector2i(2, 2), 7);
+	u32 background[32 * 32];
+	TEST_ASSERT(chunk->background.decode_shared(background), "background not decoded");
+	TEST_ASSERT(background[2 + 2 * 32] == 7, "wrong shared background");
+	chunk->free_background();
+	TEST_ASSERT(!chunk->background.decode_shared(background), "empty background decoded");
+	TEST_ASSERT(Background::get_num_used() == 0, "retired background counted as used");
+
+	Grid::clear();
+}
+
+void test_cell_buffer() {
+	Grid::clear();
+	Grid::try_create_chunk(Vector2i(0, 0));
+	Grid::try_create_chunk(Vector2i(1, 0));
+	Grid::get_chunk(Vector2i(1, 0))->fill(3);
+
+	Ref<CellBuffer> buffer = Ref<CellBuffer>(memnew(CellBuffer));
+	Rect2i rect = Rect2i(-10, 4, 80, 20);
+	TypedArray<Rect2i> updated_rects = buffer->update(rect);
+	TEST_ASSERT(updated_rects.size() == 1, "new rect not fully updated");
+	TEST_ASSERT(Rect2i(updated_rects[0]) == Rect2i(Vector2i(), rect.size), "wrong full update rect");
+	TEST_ASSERT(buffer->update(rect).is_empty(), "updated without change");
+
+	Grid::get_chunk(Vector2i(0, 0))->set_cell(Vector2i(5, 6), 7);
+	updated_rects = buffer->update(rect);
+	TEST_ASSERT(updated_rects.size() == 1, "changed chunk not updated");
+	TEST_ASSERT(Rect2i(updated_rects[0]) == Rect2i(10, 0, 32, 20), "wrong updated rect");
+
+	// Same cells as a new buffer.
+	Vector<u8> data = buffer->get_image()->get_data();
+	Vector<u8> expected = Grid::get_cell_buffer(rect, false, false)->get_data();
+	TEST_ASSERT(data == expected, "wrong cell buffer");
+
+	// Compressing does not change cells, but still updates once.
+	TypedArray<Rect2i> keep_rects = TypedArray<Rect2i>();
+	Grid::set_tick(100 + Grid::get_compress_after_ticks());
+	Grid::compress_old_chunks(keep_rects);
+	TEST_ASSERT(!buffer->update(rect).is_empty(), "compressed chunk not updated");
+	TEST_ASSERT(buffer->update(rect).is_empty(), "compressed chunk updated twice");
+	TEST_ASSERT(buffer->get_image()->get_data() == expected, "wrong compressed cell buffer");
+
+	Grid::clear();
+}
+
+void test_get_cell_buffer() {
+	Grid::clear();
+	Rng rng = Rng(3);
+	for (i32 x = 0; x < 2; x++) {
+		Grid::try_create_chunk(Vector2i(x, 0));
+		Chunk *chunk = Grid::get_chunk(Vector2i(x, 0));
+		for (i32 i = 0; i < 32 * 32; i++) {
+			chunk->set_cell(Vector2i(i % 32, i / 32), rng.gen_u32());
+		}
+	}
+
+	// Partial rows of both chunks and a missing chunk.
+	Rect2i rect = Rect2i(5, 7, 40, 30);
+	for (i32 clean = 0; clean < 2; clean++) {
+		Vector<u8> data = Grid::get_cell_buffer(rect, false, clean == 1)->get_data();
+		const u32 *pixels = reinterpret_cast<const u32 *>(data.ptr());
+		Iter2D iter = Iter2D(rect.size);
+		while (iter.next()) {
+			u32 cell = Grid::get_cell_data_v(iter.coord + rect.position);
+			if (clean == 1) {
+				Cell::clean(cell);
+			}
+			TEST_ASSERT(pixels[iter.coord.x + iter.coord.y * rect.size.x] == cell, "wrong cell buffer");
+		}
+
+		// Same with bands copied on worker threads.
+		TEST_ASSERT(
+				Grid::get_cell_buffer(rect, false, clean == 1, 0)->get_data() == data,
+				"wrong threaded cell buffer");
+	}
+
+	Grid::clear();
+}
+
+void test_cell_buffer_layers() {
+	Grid::clear();
+	Rng rng = Rng(9);
+	for (i32 x = 0; x < 3; x++) {
+		Grid::try_create_chunk(Vector2i(x, 0));
+		Chunk *chunk = Grid::get_chunk(Vector2i(x, 0));
+		for (i32 i = 0; i < 32 * 32; i++) {
+			chunk->set_cell(Vector2i(i % 32, i / 32), rng.gen_u32());
+		}
+	}
+	// Only the middle chunk has a background.
+	for (i32 i = 0; i < 32 * 32; i += 5) {
+		Grid::get_chunk(Vector2i(1, 0))->set_background(Vector2i(i % 32, i / 32), rng.gen_range_u32(1, 16));
+	}
+
+	Rect2i rect = Rect2i(5, 3, 90, 40);
+	Ref<CellBuffer> buffer = Ref<CellBuffer>(memnew(CellBuffer));
+	buffer->set_background(true);
+	buffer->set_clean(true);
+	for (i32 compressed = 0; compressed < 2; compressed++) {
+		if (compressed == 1) {
+			TypedArray<Rect2i> keep_rects = TypedArray<Rect2i>();
+			Grid::set_tick(100 + Grid::get_compress_after_ticks());
+			Grid::compress_old_chunks(keep_rects);
+		}
+
+		Vector<u8> expected = Grid::get_cell_buffer(rect, false, true)->get_data();
+		Vector<u8> expected_background = Grid::get_cell_buffer(rect, true, true)->get_data();
+
+		Array images = Grid::get_cell_buffers(rect, true);
+		TEST_ASSERT(Ref<Image>(images[0])->get_data() == expected, "wrong fused foreground");
+		TEST_ASSERT(Ref<Image>(images[1])->get_data() == expected_background, "wrong fused background");
+
+		buffer->update(rect);
+		TEST_ASSERT(buffer->get_image()->get_data() == expected, "wrong cell buffer foreground");
+		TEST_ASSERT(buffer->get_background_image()->get_data() == expected_background, "wrong cell buffer background");
+	}
+
+	buffer->set_foreground(false);
+	buffer->update(rect);
+	TEST_ASSERT(buffer->get_image().is_null(), "foreground kept");
+	TEST_ASSERT(buffer->get_background_image().is_valid(), "background not kept");
+
+	Grid::clear();
+}
+
+// Cells of rect in buffer's image are the same as a new buffer.
+void check_wrapped_cell_buffer(Ref<CellBuffer> buffer, Rect2i rect) {
+	Vector2i image_size = buffer->get_image()->get_size();
+	Vector<u8> data = buffer->get_image()->get_data();
+	const u32 *pixels = reinterpret_cast<const u32 *>(data.ptr());
+	Vector<u8> expected_data = Grid::get_cell_buffer(rect, false, false)->get_data();
+	const u32 *expected = reinterpret_cast<const u32 *>(expected_data.ptr());
+	Iter2D iter = Iter2D(rect.size);
+	while (iter.next()) {
+		Vector2i image_coord = mod_neg(iter.coord + rect.position, image_size);
+		TEST_ASSERT(
+				pixels[image_coord.x + image_coord.y * image_size.x] == expected[iter.coord.x + iter.coord.y * rect.size.x],
+				"wrong wrapped cell");
+	}
+}
+
+void test_cell_buffer_wrap() {
+	Grid::clear();
+	Rng rng = Rng(5);
+	for (i32 y = 0; y < 3; y++) {
+		for (i32 x = -1; x < 5; x++) {
+			Vector2i chunk_coord = Vector2i(x, y);
+			Grid::try_create_chunk(chunk_coord);
+			Chunk *chunk = Grid::get_chunk(chunk_coord);
+			for (i32 i = 0; i < 32; i++) {
+				chunk->set_cell(Vector2i(rng.gen_range_u32(0, 32), rng.gen_range_u32(0, 32)), rng.gen_range_u32(1, 100));
+			}
+		}
+	}
+
+	Ref<CellBuffer> buffer = Ref<CellBuffer>(memnew(CellBuffer));
+	buffer->set_wrap(true);
+	Rect2i rect = Rect2i(-32, 10, 64, 50);
+	buffer->update(rect);
+	TEST_ASSERT(buffer->get_image()->get_size() == Vector2i(64, 64), "size not rounded to 32");
+
+	// Moving right by a chunk only copies the column entering rect.
+	rect.position.x += 32;
+	TypedArray<Rect2i> updated_rects = buffer->update(rect);
+	TEST_ASSERT(updated_rects.size() == 2, "wrong number of updated rects");
+	for (i32 i = 0; i < updated_rects.size(); i++) {
+		Rect2i updated_rect = updated_rects[i];
+		TEST_ASSERT(updated_rect.size.x == 32, "more than the new column updated");
+	}
+
+	check_wrapped_cell_buffer(buffer, rect);
+
+	// Panning back over cells which were overwritten by the other side copies them again.
+	rect.position.x -= 32;
+	buffer->update(rect);
+	check_wrapped_cell_buffer(buffer, rect);
+
+	// Same back and forth, not aligned to chunks.
+	rect = Rect2i(-20, 10, 64, 64);
+	buffer->update(rect);
+	for (i32 dx : { 40, -40, 7, -30, 23 }) {
+		rect.position.x += dx;
+		buffer->update(rect);
+		check_wrapped_cell_buffer(buffer, rect);
+	}
+
+	Grid::clear();
+}
+
+void test_background() {
+	Chunk chunk = Chunk();
+	TEST_ASSERT(chunk.background.is_empty(), "new background allocated");
+	chunk.set_background(Vector2i(1, 2), 0);
+	TEST_ASSERT(chunk.background.is_empty(), "empty background allocated");
+
+	// Grow past 4 bits, then past 8 bits.
+	Rng rng = Rng(11);
+	u32 expected[32 * 32] = {};
+	const u32 NUM_VALUES[3] = { 16, 200, 1024 };
+	for (u32 num_values : NUM_VALUES) {
+		for (u32 i = 0; i < 32 * 32; i++) {
+			u32 cell = rng.gen_range_u32(0, num_values) * 0x10001;
+			chunk.set_background(Vector2i(i % 32, i / 32), cell);
+			expected[i] = cell;
+		}
+
+		u32 num_background_cell = 0;
+		u32 decoded[32 * 32];
+		chunk.background.decode(decoded);
+		for (u32 i = 0; i < 32 * 32; i++) {
+			TEST_ASSERT(chunk.get_background(Vector2i(i % 32, i / 32)) == expected[i], "wrong background cell");
+			TEST_ASSERT(decoded[i] == expected[i], "wrong decoded background");
+			num_background_cell += u32(expected[i] != 0);
+		}
+		TEST_ASSERT(chunk.num_background_cell == num_background_cell, "wrong num_background_cell");
+	}
+
+	chunk.free_background();
+	TEST_ASSERT(chunk.num_background_cell == 0, "num_background_cell not reset");
+
+	// Unused values are dropped when the palette is full.
+	for (u32 i = 0; i < 32 * 32; i++) {
+		chunk.set_background(Vector2i(i % 32, i / 32), i % 16);
+	}
+	for (u32 i = 0; i < 32 * 32; i++) {
+		chunk.set_background(Vector2i(i % 32, i / 32), 1);
+	}
+	chunk.set_background(Vector2i(5, 0), 100);
+	TEST_ASSERT(chunk.get_background(Vector2i(5, 0)) == 100, "wrong background after repack");
+	TEST_ASSERT(chunk.get_background(Vector2i(6, 0)) == 1, "wrong background after repack");
+	TEST_ASSERT(Background::get_num_used() == 1, "background leaked");
+	TEST_ASSERT(Background::get_used_bytes() == 16 * 4 + 32 * 32 / 2, "palette grew instead of dropping values");
+
+	chunk.free_background();
+	TEST_ASSERT(chunk.background.is_empty(), "background not freed");
+	TEST_ASSERT(Background::get_num_used() == 0, "background block not freed");
+}
+
+void test_step_rects() {
+	Grid::clear();
+	// Default material as air.
+	Object *obj = memnew(Object);
+	Grid::add_cell_material(obj);
+	memdelete(obj);
+	Grid::set_tick(1);
+
+	// Overlapping rects.
+	TypedArray<Rect2i> rects = TypedArray<Rect2i>();
+	rects.push_back(Rect2i(0, 0, 2, 3));
+	rects.push_back(Rect2i(1, 2, 2, 1));
+
+	Grid::prepare_step_rects(rects);
+	TEST_ASSERT(Grid::get_chunk(Vector2i(-1, -1))->needs_generation, "new chunk not marked");
+	TEST_ASSERT(Grid::get_chunk(Vector2i(3, 3))->needs_generation, "new chunk not marked");
+	TEST_ASSERT(!Grid::chunk_exists(Vector2i(3, -1)), "chunk created outside rects");
+
+	Grid::step_rects(rects);
+	for (i32 y = -1; y < 4; y++) {
+		for (i32 x = -1; x < 4; x++) {
+			Chunk *chunk = Grid::get_chunk(Vector2i(x, y));
+			if (chunk == nullptr) {
+				continue;
+			}
+
+			TEST_ASSERT(!chunk->needs_generation, "chunk not generated");
+			bool stepped = Rect2i(0, 0, 2, 3).has_point(Vector2i(x, y)) || Rect2i(1, 2, 2, 1).has_point(Vector2i(x, y));
+			TEST_ASSERT((chunk->last_step_tick == 1) == stepped, "wrong chunk stepped");
+		}
+	}
+
+	Grid::clear();
+	Grid::clear_cell_materials();
+}
+
+void test_step_active_rects() {
+	Grid::clear();
+	Object *obj = memnew(Object);
+	Grid::add_cell_material(obj);
+	memdelete(obj);
+
+	TypedArray<Rect2i> rects = TypedArray<Rect2i>();
+	rects.push_back(Rect2i(0, 0, 4, 4));
+
+	// New rects step every chunk.
+	Grid::set_tick(1);
+	Grid::prepare_step_rects(rects);
+	Grid::step_active_rects(rects);
+	for (i32 y = 0; y < 4; y++) {
+		for (i32 x = 0; x < 4; x++) {
+			TEST_ASSERT(Grid::get_chunk(Vector2i(x, y))->last_step_tick == 1, "chunk not stepped");
+		}
+	}
+
+	// Air does not stay active, so only the edited chunk is stepped.
+	Grid::set_tick(2);
+	Grid::set_cell_material_idx_v(Vector2i(40, 40), 0);
+	Grid::prepare_step_rects(rects);
+	Grid::step_active_rects(rects);
+	TEST_ASSERT(Grid::get_chunk(Vector2i(1, 1))->last_step_tick == 2, "active chunk not stepped");
+	TEST_ASSERT(Grid::get_chunk(Vector2i(3, 3))->last_step_tick == 1, "inactive chunk stepped");
+
+	Grid::set_tick(3);
+	Grid::prepare_step_rects(rects);
+	Grid::step_active_rects(rects);
+	TEST_ASSERT(Grid::get_chunk(Vector2i(1, 1))->last_step_tick == 2, "inactive chunk stepped");
+
+	// Changed rects only step chunks entering them.
+	rects.push_back(Rect2i(4, 0, 1, 1));
+	Grid::set_tick(4);
+	Grid::prepare_step_rects(rects);
+	Grid::step_active_rects(rects);
+	TEST_ASSERT(Grid::get_chunk(Vector2i(3, 3))->last_step_tick == 1, "inactive chunk stepped");
+	TEST_ASSERT(Grid::get_chunk(Vector2i(4, 0))->last_step_tick == 4, "chunk entering rects not stepped");
+
+	// Moving rects, like a camera would.
+	rects.clear();
+	rects.push_back(Rect2i(1, 0, 4, 4));
+	Grid::set_tick(5);
+	Grid::prepare_step_rects(rects);
+	Grid::step_active_rects(rects);
+	TEST_ASSERT(Grid::get_chunk(Vector2i(4, 3))->last_step_tick == 5, "chunk entering rects not stepped");
+	TEST_ASSERT(Grid::get_chunk(Vector2i(4, 0))->last_step_tick == 4, "chunk already in rects stepped");
+	TEST_ASSERT(Grid::get_chunk(Vector2i(2, 2))->last_step_tick == 1, "inactive chunk stepped");
+
+	// A reaction change steps every chunk.
+	Grid::set_tick(6);
+	Grid::add_cell_reaction(0, 0, 0, 0, 1, Callable());
+	Grid::prepare_step_rects(rects);
+	Grid::step_active_rects(rects);
+	TEST_ASSERT(Grid::get_chunk(Vector2i(2, 2))->last_step_tick == 6, "chunk not force stepped");
+
+	Grid::clear();
+	Grid::clear_cell_reactions();
+	Grid::clear_cell_materials();
+}
+
+void test_step_uniform_chunk() {
+	Grid::clear();
+	Object *obj = memnew(Object);
+	Grid::add_cell_material(obj);
+	memdelete(obj);
+
+	TypedArray<Rect2i> rects = TypedArray<Rect2i>();
+	rects.push_back(Rect2i(0, 0, 3, 1));
+	Grid::set_tick(1);
+	Grid::prepare_step_rects(rects);
+
+	// Same active static cell, uniform or not.
+	u32 cell = 0;
+	Cell::set_active(cell);
+	Cell::set_flow(cell, 1);
+	Chunk *uniform = Grid::get_chunk(Vector2i(0, 0));
+	uniform->fill(cell);
+	Chunk *materialized = Grid::get_chunk(Vector2i(1, 0));
+	materialized->fill(cell);
+	materialized->materialize();
+
+	Grid::step_rects(rects);
+	TEST_ASSERT(uniform->is_uniform(), "uniform chunk materialized");
+	TEST_ASSERT(Grid::get_chunk(Vector2i(2, 0))->is_uniform(), "new air chunk materialized");
+	for (i32 i = 0; i < 32 * 32; i++) {
+		TEST_ASSERT(materialized->cells[i] == uniform->uniform_cell, "uniform chunk stepped differently");
+	}
+
+	Grid::clear();
+	Grid::clear_cell_materials();
+}
+
+void test_step_budget() {
+	Grid::clear();
+	Object *obj = memnew(Object);
+	Grid::add_cell_material(obj);
+	memdelete(obj);
+
+	TypedArray<Rect2i> rects = TypedArray<Rect2i>();
+	rects.push_back(Rect2i(0, 0, 4, 4));
+	TypedArray<Rect2i> priority_rects = TypedArray<Rect2i>();
+	priority_rects.push_back(Rect2i(2, 2, 2, 2));
+
+	// Priority chunks first, then lowest coords as none were stepped.
+	Grid::set_tick(1);
+	Grid::prepare_step_rects(rects);
+	Grid::step_active_rects(rects, 6, priority_rects);
+	TEST_ASSERT(Grid::get_num_deferred_chunks() == 10, "wrong number of deferred chunks");
+	for (i32 y = 2; y < 4; y++) {
+		for (i32 x = 2; x < 4; x++) {
+			TEST_ASSERT(Grid::get_chunk(Vector2i(x, y))->last_step_tick == 1, "priority chunk not stepped");
+		}
+	}
+	TEST_ASSERT(Grid::get_chunk(Vector2i(0, 0))->last_step_tick == 1, "oldest chunk not stepped");
+	TEST_ASSERT(Grid::get_chunk(Vector2i(0, 1))->last_step_tick == 1, "oldest chunk not stepped");
+	TEST_ASSERT(Grid::get_chunk(Vector2i(3, 0))->last_step_tick == -1, "chunk over budget stepped");
+
+	// Deferred chunks are stepped before those stepped last tick.
+	Grid::set_tick(2);
+	Grid::step_active_rects(rects, 10, priority_rects);
+	TEST_ASSERT(Grid::get_num_deferred_chunks() == 0, "deferred chunks not stepped");
+	for (i32 y = 0; y < 4; y++) {
+		for (i32 x = 0; x < 4; x++) {
+			TEST_ASSERT(Grid::get_chunk(Vector2i(x, y))->last_step_tick >= 1, "deferred chunk not stepped");
+		}
+	}
+
+	Grid::clear();
+	Grid::clear_cell_materials();
+}
+
+static std::atomic<i32> test_num_steps = 0;
+static std::atomic<bool> test_step_blocked = false;
+
+void count_test_step() {
+	test_num_steps += 1;
+}
+
+void blocked_test_step() {
+	while (test_step_blocked.load()) {
+	}
+	test_num_steps += 1;
+}
+
+void test_step_driver() {
+	Grid::clear();
+	test_num_steps = 0;
+
+	TEST_ASSERT(Grid::try_finish_step(), "no step should be running");
+	Grid::start_step(callable_mp_static(&count_test_step));
+	Grid::finish_step();
+	TEST_ASSERT(!Grid::is_step_running(), "step still running");
+	TEST_ASSERT(test_num_steps == 1, "step not called");
+
+	Grid::start_step(callable_mp_static(&count_test_step));
+	while (!Grid::try_finish_step()) {
+	}
+	TEST_ASSERT(test_num_steps == 2, "step not called");
+
+	Dictionary stats = Grid::get_step_stats();
+	i64 skipped_ticks = stats["skipped_ticks"];
+	i64 late_ticks = stats["late_ticks"];
+	TEST_ASSERT(late_ticks == 0, "no step started after a skipped tick");
+
+	Grid::start_step(callable_mp_static(&count_test_step));
+	Grid::finish_step();
+	stats = Grid::get_step_stats();
+	i64 new_late_ticks = stats["late_ticks"];
+	TEST_ASSERT(new_late_ticks == (skipped_ticks > 0 ? 1 : 0), "wrong late ticks");
+
+	// Idle frames with nothing to step are not skipped ticks.
+	test_step_blocked = true;
+	Grid::start_step(callable_mp_static(&blocked_test_step));
+	TEST_ASSERT(!Grid::try_finish_step(false), "blocked step finished");
+	stats = Grid::get_step_stats();
+	TEST_ASSERT(i64(stats["skipped_ticks"]) == skipped_ticks, "skipped tick counted while idle");
+	TEST_ASSERT(!Grid::try_finish_step(true), "blocked step finished");
+	stats = Grid::get_step_stats();
+	TEST_ASSERT(i64(stats["skipped_ticks"]) == skipped_ticks + 1, "skipped tick not counted");
+	test_step_blocked = false;
+	Grid::finish_step();
+	TEST_ASSERT(test_num_steps == 4, "step not called");
+
+	// Regions inflated while stepping are linked once the step is finished.
+	Grid::try_create_chunk(Vector2i(15, 0));
+	Grid::try_create_chunk(Vector2i(16, 0));
+	TypedArray<Rect2i> keep_rects = TypedArray<Rect2i>();
+	keep_rects.push_back(Rect2i(14, 0, 1, 1));
+	Grid::set_tick(Grid::get_compress_after_ticks() + 1);
+	TEST_ASSERT(Grid::compress_old_chunks(keep_rects) == 1, "region not compressed");
+
+	test_step_blocked = true;
+	Grid::start_step(callable_mp_static(&blocked_test_step));
+	Chunk *inflated = Grid::get_chunk(Vector2i(16, 0));
+	TEST_ASSERT(inflated != nullptr, "compressed chunk not found");
+	TEST_ASSERT(Grid::get_chunk(Vector2i(15, 0))->neighbors[5] == nullptr, "region linked while stepping");
+	test_step_blocked = false;
+	Grid::finish_step();
+	TEST_ASSERT(Grid::get_chunk(Vector2i(15, 0))->neighbors[5] == inflated, "region not linked after step");
+
+	Grid::clear();
+}
+
+void test_reaction_table() {
+	Object *obj = memnew(Object);
+	for (i32 i = 0; i < 3; i++) {
+		Grid::add_cell_material(obj);
+	}
+	memdelete(obj);
+
+	u64 id = Grid::add_cell_reaction(2, 1, 0, 0, 1.0, Callable());
+	Grid::add_cell_reaction(1, 2, 1, 1, 1.0, Callable());
+	Grid::build_reaction_table();
+
+	CellReaction *start = nullptr;
+	CellReaction *end = nullptr;
+	bool swap = false;
+	Grid::reactions_between(start, end, 2, 1, swap);
+	TEST_ASSERT(start != nullptr && end - start == 2, "wrong number of reactions");
+	TEST_ASSERT(swap, "reaction not swapped");
+	Grid::reactions_between(start, end, 1, 2, swap);
+	TEST_ASSERT(start != nullptr && !swap, "reaction not found");
+	Grid::reactions_between(start, end, 0, 1, swap);
+	TEST_ASSERT(start == nullptr, "reaction with non-reactive material");
+	Grid::reactions_between(start, end, 1, 1, swap);
+	TEST_ASSERT(start == nullptr, "reaction between reactive materials without reaction");
+
+	TEST_ASSERT(Grid::remove_cell_reaction(id), "reaction not removed");
+	Grid::build_reaction_table();
+	Grid::reactions_between(start, end, 2, 1, swap);
+	TEST_ASSERT(start != nullptr && end - start == 1, "removed reaction still there");
+
+	Grid::clear_cell_reactions();
+	Grid::build_reaction_table();
+	Grid::reactions_between(start, end, 2, 1, swap);
+	TEST_ASSERT(start == nullptr, "cleared reaction still there");
+
+	Grid::clear_cell_materials();
+}
+
+static std::vector<PackedVector2iArray> test_batches = {};
+static std::vector<Vector2i> test_single_coords = {};
+
+void record_test_batch(PackedVector2iArray coords) {
+	test_batches.push_back(coords);
+}
+
+void record_test_single(Vector2i coord) {
+	test_single_coords.push_back(coord);
+}
+
+void test_reaction_batches() {
+	Grid::clear();
+	for (i32 i = 0; i < 4; i++) {
+		Grid::push_cell_material(CellMaterial());
+	}
+
+	// Both reactions share the same batch callback.
+	Callable batch = callable_mp_static(&record_test_batch);
+	Grid::add_cell_reaction(1, 2, 0, 0, 1.0, batch, true);
+	Grid::add_cell_reaction(1, 3, 0, 0, 1.0, batch, true);
+	Grid::add_cell_reaction(2, 3, 0, 0, 1.0, callable_mp_static(&record_test_single));
+
+	TypedArray<Rect2i> rects = TypedArray<Rect2i>();
+	rects.push_back(Rect2i(0, 0, 2, 1));
+	Grid::prepare_step_rects(rects);
+
+	// Pairs on a row, triggered at their left cell (in1), across 2 chunks.
+	const i32 PAIRS[5][3] = {
+		{ 2, 1, 3 },
+		{ 10, 1, 2 },
+		{ 20, 2, 3 },
+		{ 24, 2, 3 },
+		{ 40, 1, 2 },
+	};
+	for (const i32 *pair : PAIRS) {
+		Grid::set_cell_material_idx_v(Vector2i(pair[0], 5), pair[1]);
+		Grid::set_cell_material_idx_v(Vector2i(pair[0] + 1, 5), pair[2]);
+	}
+
+	test_batches.clear();
+	test_single_coords.clear();
+	Grid::set_tick(1);
+	Grid::step_rects(rects);
+	Grid::post_step();
+
+	TEST_ASSERT(test_batches.size() == 1, "reactions sharing a callable not grouped");
+	TEST_ASSERT(test_batches[0].size() == 3, "wrong number of batched coords");
+	TEST_ASSERT(test_batches[0][0] == Vector2i(2, 5), "batched coords not in merge order");
+	TEST_ASSERT(test_batches[0][1] == Vector2i(10, 5), "batched coords not in merge order");
+	TEST_ASSERT(test_batches[0][2] == Vector2i(40, 5), "batched coords not in merge order");
+
+	TEST_ASSERT(test_single_coords.size() == 2, "single callback not called once per coord");
+	TEST_ASSERT(test_single_coords[0] == Vector2i(20, 5), "single callbacks not in merge order");
+	TEST_ASSERT(test_single_coords[1] == Vector2i(24, 5), "single callbacks not in merge order");
+
+	test_batches.clear();
+	test_single_coords.clear();
+	Grid::clear();
+	Grid::clear_cell_reactions();
+	Grid::clear_cell_materials();
+}
+
+static std::vector<i32> test_callback_chunks = {};
+
+void record_test_callback_left(Vector2i coord) {
+	TEST_ASSERT(coord == Vector2i(31, 5), "wrong trigger coord");
+	test_callback_chunks.push_back(0);
+}
+
+void record_test_callback_right(Vector2i coord) {
+	TEST_ASSERT(coord == Vector2i(31, 5), "wrong trigger coord");
+	test_callback_chunks.push_back(1);
+}
+
+void test_reaction_callback_order() {
+	for (i32 i = 0; i < 4; i++) {
+		Grid::push_cell_material(CellMaterial());
+	}
+	// Outputs are the inputs, so reacting never changes cells.
+	Grid::add_cell_reaction(1, 3, 1, 3, 1.0, callable_mp_static(&record_test_callback_left));
+	Grid::add_cell_reaction(1, 2, 1, 2, 1.0, callable_mp_static(&record_test_callback_right));
+
+	TypedArray<Rect2i> rects = TypedArray<Rect2i>();
+	rects.push_back(Rect2i(0, 0, 2, 1));
+
+	// Both callbacks trigger at (31, 5). One from stepping chunk (0, 0), the other from chunk (1, 0).
+	for (i32 left_first = 0; left_first < 2; left_first++) {
+		Grid::clear();
+		Grid::prepare_step_rects(rects);
+		Grid::set_cell_material_idx_v(Vector2i(31, 5), 1);
+		Grid::set_cell_material_idx_v(Vector2i(30, 6), 3);
+		Grid::set_cell_material_idx_v(Vector2i(32, 5), 2);
+
+		test_callback_chunks.clear();
+		Grid::set_tick(1);
+		if (left_first == 1) {
+			Grid::step_chunk(Vector2i(0, 0));
+			Grid::step_chunk(Vector2i(1, 0));
+		} else {
+			Grid::step_chunk(Vector2i(1, 0));
+			Grid::step_chunk(Vector2i(0, 0));
+		}
+		Grid::post_step();
+
+		TEST_ASSERT(test_callback_chunks.size() == 2, "wrong number of callbacks");
+		TEST_ASSERT(test_callback_chunks[0] == (left_first == 1 ? 0 : 1), "tie not in step_chunk order");
+		TEST_ASSERT(test_callback_chunks[1] == (left_first == 1 ? 1 : 0), "tie not in step_chunk order");
+	}
+
+	test_callback_chunks.clear();
+	Grid::clear();
+	Grid::clear_cell_reactions();
+	Grid::clear_cell_materials();
+}
+
+void test_step_material() {
+	Object *obj = memnew(Object);
+	Grid::add_cell_material(obj);
+	Grid::add_cell_material(obj);
+	memdelete(obj);
+
+	const CellMaterial &mat = Grid::get_cell_material(1);
+	const StepMaterial &step_mat = Grid::get_step_material(1);
+	TEST_ASSERT(step_mat.density == mat.density, "wrong density");
+	TEST_ASSERT(step_mat.horizontal_movement == mat.horizontal_movement, "wrong horizontal_movement");
+	TEST_ASSERT(step_mat.horizontal_movement_stop_chance == mat.horizontal_movement_stop_chance, "wrong stop chance");
+	TEST_ASSERT(step_mat.can_reverse_horizontal_movement() == mat.can_reverse_horizontal_movement, "wrong flags");
+
+	// Unknown materials step as the default one.
+	TEST_ASSERT(Grid::get_step_material(4095).horizontal_movement == Grid::get_cell_material(0).horizontal_movement, "unknown material is not default");
+
+	Grid::clear_cell_materials();
+}
+
+// Air, sand and water.
+void push_sand_water_materials() {
+	Grid::push_cell_material(CellMaterial());
+
+	CellMaterial sand = CellMaterial();
+	sand.density = 2;
+	sand.vertical_movement = 2;
+	sand.horizontal_movement_stop_chance = MAX_U32 / 2;
+	Grid::push_cell_material(sand);
+
+	CellMaterial water = CellMaterial();
+	water.density = 1;
+	water.vertical_movement = 2;
+	water.horizontal_movement = 3;
+	water.horizontal_movement_stop_chance = 0;
+	water.can_reverse_horizontal_movement = true;
+	Grid::push_cell_material(water);
+}
+
+// Fill the top half of chunk_rect with material_idx.
+void fill_top_half(Rect2i chunk_rect, u32 material_idx) {
+	Rect2i rect = Rect2i(chunk_rect.position * 32, chunk_rect.size * Vector2i(32, 16));
+	for (i32 y = rect.position.y; y < rect.get_end().y; y++) {
+		for (i32 x = rect.position.x; x < rect.get_end().x; x++) {
+			Grid::set_cell_material_idx_v(Vector2i(x, y), material_idx);
+		}
+	}
+}
+
+void test_step_kinds() {
+	Rect2i chunk_rect = Rect2i(0, 0, 2, 2);
+	TypedArray<Rect2i> rects = TypedArray<Rect2i>();
+	rects.push_back(chunk_rect);
+
+	std::vector<u32> cells[2] = {};
+	for (i32 generic = 0; generic < 2; generic++) {
+		Grid::clear();
+		push_sand_water_materials();
+		TEST_ASSERT(Grid::get_step_material(0).kind == STEP_KIND_STATIC, "air is not static");
+		TEST_ASSERT(Grid::get_step_material(1).kind == STEP_KIND_POWDER, "sand is not powder");
+		TEST_ASSERT(Grid::get_step_material(2).kind == STEP_KIND_LIQUID, "water is not liquid");
+		Grid::step_generic = generic == 1;
+
+		Grid::prepare_step_rects(rects);
+		fill_top_half(Rect2i(0, 0, 1, 2), 1);
+		fill_top_half(Rect2i(1, 0, 1, 2), 2);
+
+		for (i64 tick = 1; tick <= 16; tick++) {
+			Grid::set_tick(tick);
+			Grid::step_rects(rects);
+		}
+
+		for (i32 y = 0; y < 64; y++) {
+			for (i32 x = 0; x < 64; x++) {
+				cells[generic].push_back(Grid::get_cell_data_v(Vector2i(x, y)));
+			}
+		}
+
+		Grid::clear();
+		Grid::clear_cell_materials();
+	}
+	Grid::step_generic = false;
+
+	TEST_ASSERT(cells[0] == cells[1], "step kinds differ from generic");
+}
+
+void test_active_cells() {
+	Grid::clear();
+	push_sand_water_materials();
+
+	TypedArray<Rect2i> rects = TypedArray<Rect2i>();
+	rects.push_back(Rect2i(0, 0, 1, 1));
+	Grid::prepare_step_rects(rects);
+
+	// Air does not stay active.
+	Grid::set_tick(1);
+	Grid::step_rects(rects);
+	Chunk *chunk = Grid::get_chunk(Vector2i(0, 0));
+	for (u32 y = 0; y < 32; y++) {
+		TEST_ASSERT(chunk->active_cells[y] == 0, "air cell still active");
+	}
+
+	Grid::set_cell_material_idx_v(Vector2i(10, 5), 1);
+	TEST_ASSERT(chunk->active_cells[5] == 7u << 9, "edited cells not active");
+
+	// Sand falls by 2 and only its surroundings stay active.
+	Grid::set_tick(2);
+	Grid::step_rects(rects);
+	TEST_ASSERT(Grid::get_cell_material_idx_v(Vector2i(10, 7)) == 1, "sand did not fall");
+	TEST_ASSERT((chunk->active_cells[7] & (1u << 10)) != 0, "falling sand not active");
+	TEST_ASSERT(chunk->active_cells[20] == 0, "far cells active");
+
+	Grid::clear();
+	Grid::clear_cell_materials();
+}
+
 void PixitaleTests::_bind_methods() {
 	ClassDB::bind_static_method(
 			"PixitaleTests",
@@ -251,6 +1360,26 @@ void PixitaleTests::_bind_methods() {
 			"PixitaleTests",
 			D_METHOD("test_perf", "noise", "size"),
 			&PixitaleTests::test_perf);
+
+	ClassDB::bind_static_method(
+			"PixitaleTests",
+			D_METHOD("test_chunk_table_perf"),
+			&PixitaleTests::test_chunk_table_perf);
+
+	ClassDB::bind_static_method(
+			"PixitaleTests",
+			D_METHOD("test_step_perf"),
+			&PixitaleTests::test_step_perf);
+
+	ClassDB::bind_static_method(
+			"PixitaleTests",
+			D_METHOD("test_step_kernel_perf"),
+			&PixitaleTests::test_step_kernel_perf);
+
+	ClassDB::bind_static_method(
+			"PixitaleTests",
+			D_METHOD("test_cell_buffer_perf"),
+			&PixitaleTests::test_cell_buffer_perf);
 }
 
 void PixitaleTests::run_tests() {
@@ -266,6 +1395,32 @@ void PixitaleTests::run_tests() {
 	test_iter_chunk();
 	test_chunk_local_coord();
 	test_rng_bias();
+	test_chunk_table();
+	test_region_slot();
+	test_chunk_neighbors();
+	test_unload_old_chunks();
+	test_region_encode_cells();
+	test_compress_region();
+	test_compress_active_chunk();
+	test_compress_ungenerated_chunk();
+	test_uniform_chunk();
+	test_retired_blocks();
+	test_cell_buffer();
+	test_cell_buffer_wrap();
+	test_cell_buffer_layers();
+	test_get_cell_buffer();
+	test_background();
+	test_step_rects();
+	test_step_active_rects();
+	test_step_uniform_chunk();
+	test_step_budget();
+	test_step_driver();
+	test_reaction_table();
+	test_reaction_batches();
+	test_reaction_callback_order();
+	test_step_material();
+	test_step_kinds();
+	test_active_cells();
 }
 
 bool PixitaleTests::assert_enabled() {
@@ -289,4 +1444,235 @@ f32 PixitaleTests::test_perf(Ref<FastNoiseLite> noise, i32 size) {
 	print_line("elapsed: ", end - start, "ms");
 
 	return sum;
-}
\ No newline at end of file
+}
+
+void PixitaleTests::test_chunk_table_perf() {
+	const i32 NUM_LOOKUPS = 1000000;
+	const i32 SIZES[3] = { 10000, 100000, 1000000 };
+
+	for (i32 num_chunks : SIZES) {
+		// Explored world is roughly a square around spawn.
+		i32 width = i32(Math::sqrt(f64(num_chunks)));
+		std::vector<u64> values(num_chunks);
+		std::vector<u64> keys(num_chunks);
+		for (i32 i = 0; i < num_chunks; i++) {
+			keys[i] = test_chunk_id(Vector2i(i % width - width / 2, i / width - width / 2));
+		}
+
+		Rng rng = Rng(num_chunks);
+		std::vector<u64> lookups(NUM_LOOKUPS);
+		for (i32 i = 0; i < NUM_LOOKUPS; i++) {
+			lookups[i] = keys[rng.gen_range_u32(0, num_chunks)];
+		}
+
+		u64 sum = 0;
+
+		i64 start = Time::get_singleton()->get_ticks_usec();
+		std::unordered_map<u64, u64 *> map = {};
+		for (i32 i = 0; i < num_chunks; i++) {
+			map.emplace(keys[i], &values[i]);
+		}
+		i64 map_insert = Time::get_singleton()->get_ticks_usec() - start;
+
+		start = Time::get_singleton()->get_ticks_usec();
+		for (u64 key : lookups) {
+			if (auto it = map.find(key); it != map.end()) {
+				sum += u64(it->second - values.data());
+			}
+		}
+		i64 map_lookup = Time::get_singleton()->get_ticks_usec() - start;
+
+		start = Time::get_singleton()->get_ticks_usec();
+		ChunkTable<u64> table;
+		for (i32 i = 0; i < num_chunks; i++) {
+			*table.try_insert(keys[i]) = &values[i];
+		}
+		i64 table_insert = Time::get_singleton()->get_ticks_usec() - start;
+
+		start = Time::get_singleton()->get_ticks_usec();
+		for (u64 key : lookups) {
+			if (u64 *value = table.get(key)) {
+				sum -= u64(value - values.data());
+			}
+		}
+		i64 table_lookup = Time::get_singleton()->get_ticks_usec() - start;
+
+		TEST_ASSERT(sum == 0, "map and table disagree");
+
+		print_line("chunks:", num_chunks, "lookups:", NUM_LOOKUPS);
+		print_line("	unordered_map insert:", map_insert, "us lookup:", map_lookup, "us");
+		print_line("	ChunkTable insert:", table_insert, "us lookup:", table_lookup, "us");
+	}
+}
+
+// Powers of two below the pool's thread count, then the thread count itself.
+std::vector<i32> perf_thread_counts() {
+	i32 max_threads = WorkerThreadPool::get_singleton()->get_thread_count();
+	std::vector<i32> counts = {};
+	for (i32 num_threads = 1; num_threads < max_threads; num_threads *= 2) {
+		counts.push_back(num_threads);
+	}
+	counts.push_back(MAX(max_threads, 1));
+	return counts;
+}
+
+void PixitaleTests::test_step_perf() {
+	const i32 NUM_STEPS = 20;
+
+	// Roughly what a player sees on a tall screen.
+	Rect2i chunk_rect = Rect2i(0, 0, 6, 64);
+	TypedArray<Rect2i> rects = TypedArray<Rect2i>();
+	rects.push_back(chunk_rect);
+
+	bool step_by_column = Grid::step_by_column;
+	i32 max_step_threads = Grid::max_step_threads;
+	for (i32 num_threads : perf_thread_counts()) {
+		print_line(num_threads, "threads:");
+		Grid::max_step_threads = num_threads;
+
+		for (i32 by_column = 1; by_column >= 0; by_column--) {
+			// Sand falling on the left half, water on the right half.
+			Grid::clear();
+			push_sand_water_materials();
+			Grid::step_by_column = by_column == 1;
+
+			Grid::prepare_step_rects(rects);
+			fill_top_half(Rect2i(0, 0, 3, 64), 1);
+			fill_top_half(Rect2i(3, 0, 3, 64), 2);
+
+			i64 start = Time::get_singleton()->get_ticks_usec();
+			for (i64 tick = 1; tick <= NUM_STEPS; tick++) {
+				Grid::set_tick(tick);
+				Grid::step_rects(rects);
+			}
+			i64 elapsed = Time::get_singleton()->get_ticks_usec() - start;
+
+			print_line(by_column == 1 ? "	by column:" : "	by chunk:", elapsed / NUM_STEPS, "us per step");
+
+			Grid::clear();
+			Grid::clear_cell_materials();
+		}
+	}
+	Grid::step_by_column = step_by_column;
+	Grid::max_step_threads = max_step_threads;
+}
+
+void PixitaleTests::test_step_kernel_perf() {
+	const i32 NUM_STEPS = 60;
+	const char *SCENES[2] = { "sand", "water" };
+
+	Rect2i chunk_rect = Rect2i(0, 0, 8, 8);
+	TypedArray<Rect2i> rects = TypedArray<Rect2i>();
+	rects.push_back(chunk_rect);
+
+	bool step_generic = Grid::step_generic;
+	for (u32 scene = 0; scene < 2; scene++) {
+		print_line(SCENES[scene], "scene:");
+
+		for (i32 generic = 1; generic >= 0; generic--) {
+			Grid::clear();
+			push_sand_water_materials();
+			Grid::step_generic = generic == 1;
+
+			Grid::prepare_step_rects(rects);
+			fill_top_half(chunk_rect, scene + 1);
+
+			i64 start = Time::get_singleton()->get_ticks_usec();
+			for (i64 tick = 1; tick <= NUM_STEPS; tick++) {
+				Grid::set_tick(tick);
+				Grid::step_rects(rects);
+			}
+			i64 elapsed = Time::get_singleton()->get_ticks_usec() - start;
+
+			print_line(generic == 1 ? "	generic:" : "	specialized:", elapsed / NUM_STEPS, "us per step");
+
+			Grid::clear();
+			Grid::clear_cell_materials();
+		}
+	}
+	Grid::step_generic = step_generic;
+}
+
+void PixitaleTests::test_cell_buffer_perf() {
+	const i32 NUM_COPIES = 20;
+	const i32 SIZE = 2048;
+
+	// Mostly materialized chunks, with some uniform, missing and background ones.
+	Grid::clear();
+	Rng rng = Rng(7);
+	for (i32 y = 0; y < SIZE / 32; y++) {
+		for (i32 x = 0; x < SIZE / 32; x++) {
+			Vector2i chunk_coord = Vector2i(x, y);
+			u32 kind = rng.gen_range_u32(0, 8);
+			if (kind == 0) {
+				continue;
+			}
+
+			Grid::try_create_chunk(chunk_coord);
+			Chunk *chunk = Grid::get_chunk(chunk_coord);
+			if (kind == 1) {
+				chunk->fill(rng.gen_u32());
+				continue;
+			}
+			for (i32 i = 0; i < 32 * 32; i++) {
+				chunk->set_cell(Vector2i(i % 32, i / 32), rng.gen_u32());
+			}
+			if (kind == 2) {
+				for (i32 i = 0; i < 32 * 32; i += 3) {
+					chunk->set_background(Vector2i(i % 32, i / 32), rng.gen_range_u32(1, 16));
+				}
+			}
+		}
+	}
+
+	// Not aligned to chunks, like a camera would be.
+	Rect2i rect = Rect2i(13, 7, SIZE, SIZE);
+	for (i32 background = 0; background < 2; background++) {
+		for (i32 clean = 0; clean < 2; clean++) {
+			i64 start = Time::get_singleton()->get_ticks_usec();
+			for (i32 i = 0; i < NUM_COPIES; i++) {
+				Grid::get_cell_buffer(rect, background == 1, clean == 1);
+			}
+			i64 elapsed = Time::get_singleton()->get_ticks_usec() - start;
+
+			print_line(
+					background == 1 ? "	background" : "	foreground",
+					clean == 1 ? "clean:" : "raw:",
+					elapsed / NUM_COPIES,
+					"us per 2048x2048 buffer");
+		}
+	}
+
+	// Scaling from 1 thread to every pool thread.
+	for (i32 num_threads : perf_thread_counts()) {
+		i64 start = Time::get_singleton()->get_ticks_usec();
+		for (i32 i = 0; i < NUM_COPIES; i++) {
+			Grid::get_cell_buffer(rect, false, true, num_threads);
+		}
+		i64 elapsed = Time::get_singleton()->get_ticks_usec() - start;
+
+		print_line(
+				"	foreground clean",
+				num_threads,
+				"threads:",
+				elapsed / NUM_COPIES,
+				"us per 2048x2048 buffer");
+	}
+
+	// Both layers at once, compared to the sum of the above.
+	for (i32 clean = 0; clean < 2; clean++) {
+		i64 start = Time::get_singleton()->get_ticks_usec();
+		for (i32 i = 0; i < NUM_COPIES; i++) {
+			Grid::get_cell_buffers(rect, clean == 1);
+		}
+		i64 elapsed = Time::get_singleton()->get_ticks_usec() - start;
+
+		print_line(
+				"	both",
+				clean == 1 ? "clean:" : "raw:",
+				elapsed / NUM_COPIES,
+				"us per 2048x2048 buffer");
+	}
+
+	Grid::clear();
+}
@@ -17,6 +17,16 @@ public:
 	static bool assert_enabled();
 
 	static f32 test_perf(Ref<FastNoiseLite> noise, i32 size);
+	// Compare ChunkTable and std::unordered_map at 10k, 100k and 1m chunks.
+	static void test_chunk_table_perf();
+	// Compare stepping a portrait rect of falling sand and water by column and by chunk,
+	// from 1 thread to every pool thread.
+	static void test_step_perf();
+	// Compare generic and specialized step kernels on falling sand and water.
+	static void test_step_kernel_perf();
+	// Time get_cell_buffer on a 2048x2048 rect, foreground, background and both, raw and clean.
+	// Then from 1 thread to every pool thread.
+	static void test_cell_buffer_perf();
 };
 
 #endif
\ No newline at end of file